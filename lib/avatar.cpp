@@ -23,17 +23,26 @@
 #include "jobs/mediathumbnailjob.h"
 #include "events/eventcontent.h"
 #include "connection.h"
+#include "mediacache.h"
+#include "imagedecoder.h"
 
 #include <QtGui/QPainter>
-#include <QtCore/QPointer>
+#include <QtGui/QImageReader>
 #include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QPointer>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
+#include <QtCore/QHash>
+#include <QtCore/QTimer>
+
+#include <algorithm>
+#include <deque>
 
 using namespace QMatrixClient;
 using std::move;
 
-class Avatar::Private
+class Avatar::Private : public std::enable_shared_from_this<Avatar::Private>
 {
     public:
         explicit Private(QUrl url = {})
@@ -41,18 +50,86 @@ class Avatar::Private
         { }
         ~Private()
         {
-            if (isJobRunning(_thumbnailRequest))
-                _thumbnailRequest->abandon();
+            abandonFetch();
             if (isJobRunning(_uploadRequest))
                 _uploadRequest->abandon();
+            auto& s = store();
+            s.totalBytes -= _bytes;
+            // The weak pointer has already expired by now
+            s.entries.remove(_url);
         }
 
-        QImage get(Connection* connection, QSize size,
+        /// Images shared by all Avatar objects in the process
+        struct Store
+        {
+            Store();
+
+            QHash<QUrl, std::weak_ptr<Private>> entries;
+            qint64 totalBytes = 0;
+            qint64 budget = 64 * 1024 * 1024;
+            quint64 useCounter = 0;
+            /// Avatars waiting to be fetched; the back is served first
+            std::deque<std::weak_ptr<const Private>> fetchQueue;
+            int runningFetches = 0;
+            int maxRunningFetches = 4;
+        };
+        static Store& store()
+        {
+            static Store s;
+            return s;
+        }
+        static std::shared_ptr<Private> acquire(const QUrl& url);
+        /// Drop images of least recently used avatars, except \p keep,
+        /// until the total size of decoded images fits the budget
+        static void enforceBudget(const Private* keep = nullptr);
+        /// Start fetches from the top of the queue while there are
+        /// free slots
+        static void startFetches();
+
+        void updateBytes() const;
+        qint64 dropScaledImages() const;
+        qint64 dropImages() const;
+
+        QImage get(const Avatar* owner, Connection* connection, QSize size,
                    get_callback_t callback) const;
+        /// Forget the callback of \p owner, e.g. when it's destroyed
+        void dropCallback(const Avatar* owner) const;
+        /// Pass the callback of \p from over to \p to upon moving
+        void moveCallback(const Avatar* from, const Avatar* to) const;
+        bool needsFetch(QSize size) const;
+        void enqueueFetch(Connection* connection, QSize size,
+                          bool prefetch) const;
+        void dequeueFetch() const;
+        void startFetch() const;
+        void abandonFetch() const;
         bool upload(UploadContentJob* job, upload_callback_t callback);
 
         bool checkUrl(const QUrl& url) const;
-        QString localFile() const;
+        void setOriginalImage(QImage image) const;
+        /// Start decoding the original image; results of the decodings
+        /// started before are discarded when they come
+        template <typename DecodeFnT, typename SourceT>
+        void decodeOriginal(DecodeFnT decodeFn, const SourceT& source,
+                            QSize size) const
+        {
+            _decoding = true;
+            const auto generation = ++_generation;
+            decodeFn(source, size, context(),
+                     [this,generation] (QImage image) {
+                         if (generation == _generation)
+                             setOriginalImage(move(image));
+                     });
+        }
+        void notify() const;
+
+        /// Decoding and scaling results are delivered in the context of
+        /// this object; destroying it discards the outstanding results
+        QObject* context() const
+        {
+            if (!_context)
+                _context = std::make_unique<QObject>();
+            return _context.get();
+        }
 
         QUrl _url;
 
@@ -63,33 +140,147 @@ class Avatar::Private
         mutable enum { Unknown, Cache, Network, Banned } _imageSource = Unknown;
         mutable QPointer<MediaThumbnailJob> _thumbnailRequest = nullptr;
         mutable QPointer<BaseJob> _uploadRequest = nullptr;
-        mutable std::vector<get_callback_t> callbacks;
+        /// The latest callback of each Avatar object sharing the image
+        mutable std::vector<std::pair<const Avatar*, get_callback_t>>
+            callbacks;
+        mutable bool _decoding = false;
+        /// Changes with each decoding of the original image, so that
+        /// results of scaling an older original could be told apart
+        mutable quint64 _generation = 0;
+        mutable std::vector<QSize> _pendingSizes;
+        mutable std::unique_ptr<QObject> _context;
+        mutable qint64 _bytes = 0;
+        mutable quint64 _lastUsed = 0;
+        mutable bool _queued = false;
+        mutable QSize _fetchSize;
+        mutable QPointer<Connection> _fetchConnection;
 };
 
+Avatar::Private::Store::Store()
+{
+    // Avatars used to be cached in a directory of their own before
+    // the media cache took over; nothing reads it anymore
+    QDir legacyCacheDir {
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            % "/avatars"
+    };
+    if (legacyCacheDir.exists() && !legacyCacheDir.removeRecursively())
+        qCWarning(MAIN) << "Couldn't remove the old avatar cache at"
+                        << legacyCacheDir.path();
+}
+
+std::shared_ptr<Avatar::Private> Avatar::Private::acquire(const QUrl& url)
+{
+    auto& entry = store().entries[url];
+    if (auto p = entry.lock())
+        return p;
+    auto p = std::make_shared<Private>(url);
+    entry = p;
+    return p;
+}
+
+void Avatar::Private::updateBytes() const
+{
+    qint64 bytes = _originalImage.byteCount();
+    for (const auto& p: _scaledImages)
+        bytes += p.second.byteCount();
+    store().totalBytes += bytes - _bytes;
+    _bytes = bytes;
+}
+
+qint64 Avatar::Private::dropScaledImages() const
+{
+    const auto oldBytes = _bytes;
+    _scaledImages.clear();
+    updateBytes();
+    return oldBytes - _bytes;
+}
+
+qint64 Avatar::Private::dropImages() const
+{
+    // Images being loaded or scaled right now are left alone
+    if (_decoding || !_pendingSizes.empty())
+        return 0;
+    const auto oldBytes = _bytes;
+    _scaledImages.clear();
+    _originalImage = {};
+    // Make the next get() load the image again, from the media cache
+    if (_imageSource == Cache || _imageSource == Network)
+        _imageSource = Unknown;
+    updateBytes();
+    return oldBytes - _bytes;
+}
+
+void Avatar::Private::enforceBudget(const Private* keep)
+{
+    auto& s = store();
+    if (s.totalBytes <= s.budget)
+        return;
+    std::vector<std::shared_ptr<Private>> lru;
+    lru.reserve(size_t(s.entries.size()));
+    for (const auto& w: s.entries)
+        if (auto p = w.lock())
+            if (p->_bytes > 0 && p.get() != keep)
+                lru.push_back(move(p));
+    std::sort(lru.begin(), lru.end(), [] (const auto& a, const auto& b) {
+        return a->_lastUsed < b->_lastUsed;
+    });
+    // Scaled images are cheaper to restore than decoded originals
+    for (const auto& p: lru)
+    {
+        if (s.totalBytes <= s.budget)
+            return;
+        p->dropScaledImages();
+    }
+    for (const auto& p: lru)
+    {
+        if (s.totalBytes <= s.budget)
+            return;
+        p->dropImages();
+    }
+}
+
 Avatar::Avatar()
-    : d(std::make_unique<Private>())
+    : d(Private::acquire({}))
 { }
 
 Avatar::Avatar(QUrl url)
-    : d(std::make_unique<Private>(std::move(url)))
+    : d(Private::acquire(url))
 { }
 
-Avatar::Avatar(Avatar&&) = default;
+Avatar::Avatar(Avatar&& other)
+    : d(move(other.d))
+{
+    if (d)
+        d->moveCallback(&other, this);
+}
 
-Avatar::~Avatar() = default;
+Avatar::~Avatar()
+{
+    if (d)
+        d->dropCallback(this);
+}
 
-Avatar& Avatar::operator=(Avatar&&) = default;
+Avatar& Avatar::operator=(Avatar&& other)
+{
+    if (d)
+        d->dropCallback(this);
+    d = move(other.d);
+    if (d)
+        d->moveCallback(&other, this);
+    return *this;
+}
 
 QImage Avatar::get(Connection* connection, int dimension,
                    get_callback_t callback) const
 {
-    return d->get(connection, {dimension, dimension}, move(callback));
+    return d->get(this, connection, {dimension, dimension}, move(callback));
 }
 
 QImage Avatar::get(Connection* connection, int width, int height,
                    get_callback_t callback) const
 {
-    return d->get(connection, {width, height}, move(callback));
+    return d->get(this, connection, {width, height}, move(callback));
 }
 
 bool Avatar::upload(Connection* connection, const QString& fileName,
@@ -108,60 +299,258 @@ bool Avatar::upload(Connection* connection, QIODevice* source,
     return d->upload(connection->uploadContent(source), move(callback));
 }
 
+void Avatar::prefetch(Connection* connection, int dimension) const
+{
+    prefetch(connection, dimension, dimension);
+}
+
+void Avatar::prefetch(Connection* connection, int width, int height) const
+{
+    const QSize size { width, height };
+    // Already queued prefetches keep their place in the queue
+    if (d->_queued || !d->needsFetch(size)
+            || !MediaCache::instance().find(d->_url, size).isEmpty())
+        return;
+    d->enqueueFetch(connection, size, true);
+}
+
+void Avatar::cancelFetch() const
+{
+    if (!d->_queued)
+        return;
+    d->dequeueFetch();
+    if (!isJobRunning(d->_thumbnailRequest) && !d->_decoding
+            && d->_pendingSizes.empty())
+        d->callbacks.clear();
+}
+
+int Avatar::maxConcurrentFetches()
+{
+    return Private::store().maxRunningFetches;
+}
+
+void Avatar::setMaxConcurrentFetches(int newMax)
+{
+    Private::store().maxRunningFetches = newMax;
+    Private::startFetches();
+}
+
+int Avatar::queuedFetchesCount()
+{
+    return int(Private::store().fetchQueue.size());
+}
+
 QString Avatar::mediaId() const
 {
     return d->_url.authority() + d->_url.path();
 }
 
-QImage Avatar::Private::get(Connection* connection, QSize size,
-                            get_callback_t callback) const
+QImage Avatar::Private::get(const Avatar* owner, Connection* connection,
+                            QSize size, get_callback_t callback) const
 {
     if (!callback)
     {
         qCCritical(MAIN) << "Null callbacks are not allowed in Avatar::get";
         Q_ASSERT(false);
     }
+    _lastUsed = ++store().useCounter;
 
-    if (_imageSource == Unknown && _originalImage.load(localFile()))
+    if (_imageSource == Unknown && checkUrl(_url))
     {
-        _imageSource = Cache;
-        _requestedSize = _originalImage.size();
+        const auto cachedFile = MediaCache::instance().find(_url, size);
+        const auto cachedSize = cachedFile.isEmpty()
+                                ? QSize() : QImageReader(cachedFile).size();
+        if (cachedSize.isValid())
+        {
+            _imageSource = Cache;
+            _requestedSize = cachedSize;
+            decodeOriginal(decodeImageFileAsync, cachedFile, {});
+        }
     }
 
+    // Requesting the avatar again while it's queued moves it to the top
+    if (needsFetch(size))
+        enqueueFetch(connection, size, false);
+
+    // The smallest image that is at least as large as requested is
+    // the best source for a stand-in; the original is the last resort
+    const QImage* nearest = nullptr;
+    for (const auto& p: _scaledImages)
+    {
+        if (p.first == size)
+            return p.second;
+        if (p.first.width() >= size.width() && p.first.height() >= size.height()
+                && (!nearest || p.second.width() < nearest->width()))
+            nearest = &p.second;
+    }
+    if (!nearest && !_originalImage.isNull())
+        nearest = &_originalImage;
+
+    // Scaling is done in a worker thread too; the callback is invoked
+    // when the image of the requested size is ready
+    if (!_originalImage.isNull() && !_decoding
+            && std::find(_pendingSizes.begin(), _pendingSizes.end(), size)
+                == _pendingSizes.end())
+    {
+        _pendingSizes.push_back(size);
+        scaleImageAsync(_originalImage, size, context(),
+            [this,size,generation=_generation] (QImage image) {
+                // The original has been replaced, and _pendingSizes reset,
+                // while scaling
+                if (generation != _generation)
+                    return;
+                _pendingSizes.erase(std::remove(_pendingSizes.begin(),
+                                                _pendingSizes.end(), size),
+                                    _pendingSizes.end());
+                _scaledImages.emplace_back(size, move(image));
+                updateBytes();
+                enforceBudget(this);
+                notify();
+            });
+    }
+    // Each of the Avatar objects sharing this image gets notified, once
+    if (callback)
+    {
+        const auto it = std::find_if(callbacks.begin(), callbacks.end(),
+            [owner] (const auto& c) { return c.first == owner; });
+        if (it != callbacks.end())
+            it->second = move(callback);
+        else
+            callbacks.emplace_back(owner, move(callback));
+    }
+    // A quick and rough downscale to show until the smooth one is ready
+    if (nearest && !nearest->isNull())
+        return nearest->scaled(size, Qt::KeepAspectRatio,
+                               Qt::FastTransformation);
+    return {};
+}
+
+void Avatar::Private::dropCallback(const Avatar* owner) const
+{
+    callbacks.erase(std::remove_if(callbacks.begin(), callbacks.end(),
+                        [owner] (const auto& c) { return c.first == owner; }),
+                    callbacks.end());
+}
+
+void Avatar::Private::moveCallback(const Avatar* from, const Avatar* to) const
+{
+    for (auto& c: callbacks)
+        if (c.first == from)
+            c.first = to;
+}
+
+bool Avatar::Private::needsFetch(QSize size) const
+{
     // Alternating between longer-width and longer-height requests is a sure way
     // to trick the below code into constantly getting another image from
     // the server because the existing one is alleged unsatisfactory.
     // Client authors can only blame themselves if they do so.
-    if (((_imageSource == Unknown && !_thumbnailRequest) ||
+    return ((_imageSource == Unknown && !_thumbnailRequest) ||
             size.width() > _requestedSize.width() ||
-            size.height() > _requestedSize.height()) && checkUrl(_url)) {
-        qCDebug(MAIN) << "Getting avatar from" << _url.toString();
-        _requestedSize = size;
-        if (isJobRunning(_thumbnailRequest))
-            _thumbnailRequest->abandon();
-        if (callback)
-            callbacks.emplace_back(move(callback));
-        _thumbnailRequest = connection->getThumbnail(_url, size);
-        QObject::connect( _thumbnailRequest, &MediaThumbnailJob::success,
-            _thumbnailRequest, [this] {
-                _imageSource = Network;
-                _originalImage =
-                        _thumbnailRequest->scaledThumbnail(_requestedSize);
-                _originalImage.save(localFile());
-                _scaledImages.clear();
-                for (const auto& n: callbacks)
-                    n();
-                callbacks.clear();
-            });
+            size.height() > _requestedSize.height()) && checkUrl(_url);
+}
+
+void Avatar::Private::enqueueFetch(Connection* connection, QSize size,
+                                   bool prefetch) const
+{
+    dequeueFetch();
+    _fetchConnection = connection;
+    _fetchSize = size;
+    auto& queue = store().fetchQueue;
+    if (prefetch)
+        queue.push_front(shared_from_this());
+    else
+        queue.push_back(shared_from_this());
+    _queued = true;
+    startFetches();
+}
+
+void Avatar::Private::dequeueFetch() const
+{
+    if (!_queued)
+        return;
+    auto& queue = store().fetchQueue;
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                    [this] (const std::weak_ptr<const Private>& w) {
+                        return w.lock().get() == this;
+                    }), queue.end());
+    _queued = false;
+}
+
+void Avatar::Private::startFetches()
+{
+    auto& s = store();
+    while (s.runningFetches < s.maxRunningFetches && !s.fetchQueue.empty())
+    {
+        const auto p = s.fetchQueue.back().lock();
+        s.fetchQueue.pop_back();
+        if (!p)
+            continue;
+        p->_queued = false;
+        if (p->_fetchConnection)
+            p->startFetch();
     }
+}
 
-    for (const auto& p: _scaledImages)
-        if (p.first == size)
-            return p.second;
-    auto result = _originalImage.isNull() ? QImage() : _originalImage.scaled(size,
-                    Qt::KeepAspectRatio, Qt::SmoothTransformation);
-    _scaledImages.emplace_back(size, result);
-    return result;
+void Avatar::Private::startFetch() const
+{
+    qCDebug(MAIN) << "Getting avatar from" << _url.toString();
+    abandonFetch();
+    const auto size = _requestedSize = _fetchSize;
+    const auto job = _thumbnailRequest =
+            _fetchConnection->getThumbnail(_url, size);
+    ++store().runningFetches;
+    // abandon() disconnects the job before it finishes, so abandoned
+    // fetches are accounted for in abandonFetch() instead. finished() comes
+    // before success(), by which time another fetch may have been started,
+    // hence the job and the size are captured below.
+    QObject::connect(job, &BaseJob::finished,
+                     [] { --store().runningFetches; startFetches(); });
+    QObject::connect(job, &MediaThumbnailJob::success, job, [this,job,size] {
+        _imageSource = Network;
+        const auto data = job->thumbnailData();
+        // Cache the image as received, without re-encoding it
+        auto& cache = MediaCache::instance();
+        QFile cacheFile { cache.partialFilePath(_url, size) };
+        if (cacheFile.open(QIODevice::WriteOnly)
+                && cacheFile.write(data) == data.size())
+        {
+            cacheFile.close();
+            if (!cache.commit(_url, size))
+                cacheFile.remove();
+        }
+        decodeOriginal(decodeImageAsync, data, size);
+    });
+}
+
+void Avatar::Private::abandonFetch() const
+{
+    if (!isJobRunning(_thumbnailRequest))
+        return;
+    _thumbnailRequest->abandon();
+    --store().runningFetches;
+    // Not starting right away as this may be called from the destructor
+    QTimer::singleShot(0, &Private::startFetches);
+}
+
+void Avatar::Private::setOriginalImage(QImage image) const
+{
+    _decoding = false;
+    _originalImage = move(image);
+    _scaledImages.clear();
+    _pendingSizes.clear();
+    updateBytes();
+    enforceBudget(this);
+    notify();
+}
+
+void Avatar::Private::notify() const
+{
+    // Callbacks may call get() again, adding new callbacks
+    const auto currentCallbacks = move(callbacks);
+    callbacks.clear();
+    for (const auto& c: currentCallbacks)
+        c.second();
 }
 
 bool Avatar::Private::upload(UploadContentJob* job, upload_callback_t callback)
@@ -190,11 +579,6 @@ bool Avatar::Private::checkUrl(const QUrl& url) const
     return _imageSource != Banned;
 }
 
-QString Avatar::Private::localFile() const {
-    static const auto cachePath = cacheLocation("avatars");
-    return cachePath % _url.authority() % '_' % _url.fileName() % ".png";
-}
-
 QUrl Avatar::url() const { return d->_url; }
 
 bool Avatar::updateUrl(const QUrl& newUrl)
@@ -202,9 +586,47 @@ bool Avatar::updateUrl(const QUrl& newUrl)
     if (newUrl == d->_url)
         return false;
 
-    d->_url = newUrl;
-    d->_imageSource = Private::Unknown;
-    if (isJobRunning(d->_thumbnailRequest))
-        d->_thumbnailRequest->abandon();
+    // Other Avatar objects may still use the image for the old URL
+    d->dropCallback(this);
+    d = Private::acquire(newUrl);
     return true;
 }
+
+qint64 Avatar::decodedBytes() const
+{
+    return d->_bytes;
+}
+
+qint64 Avatar::memoryBudget()
+{
+    return Private::store().budget;
+}
+
+void Avatar::setMemoryBudget(qint64 bytes)
+{
+    Private::store().budget = bytes;
+    Private::enforceBudget();
+}
+
+qint64 Avatar::memoryUsage()
+{
+    return Private::store().totalBytes;
+}
+
+qint64 Avatar::dropScaledImages()
+{
+    qint64 bytesFreed = 0;
+    for (const auto& w: Private::store().entries)
+        if (const auto p = w.lock())
+            bytesFreed += p->dropScaledImages();
+    return bytesFreed;
+}
+
+qint64 Avatar::dropDecodedImages()
+{
+    qint64 bytesFreed = 0;
+    for (const auto& w: Private::store().entries)
+        if (const auto p = w.lock())
+            bytesFreed += p->dropImages();
+    return bytesFreed;
+}
@@ -40,11 +40,39 @@ namespace QMatrixClient
             using get_callback_t = std::function<void()>;
             using upload_callback_t = std::function<void(QString)>;
 
+            /** Get the avatar image fitting the requested size
+             * If the image of this size is not ready yet, a rough
+             * downscale of an image already at hand is returned, or a null
+             * image if there's none; the image is then fetched, decoded
+             * and scaled in the background, and \p callback is invoked
+             * once it can be obtained with another call to get().
+             */
             QImage get(Connection* connection, int dimension,
                        get_callback_t callback) const;
             QImage get(Connection* connection, int w, int h,
                        get_callback_t callback) const;
 
+            /** Fetch the avatar in advance, with no callback
+             * Avatar fetches go through a process-wide queue, the most
+             * recently requested ones being fetched first; prefetches are
+             * put at the bottom of the queue, below any get() requests.
+             * Nothing is done if the image is in the media cache already.
+             */
+            void prefetch(Connection* connection, int dimension) const;
+            void prefetch(Connection* connection, int w, int h) const;
+            /** Withdraw the fetch if it's still in the queue
+             * Since images are shared by all Avatar objects with the same
+             * URL, this cancels the fetch for all of them. Fetches that
+             * have already started are not affected.
+             */
+            void cancelFetch() const;
+
+            /// The number of avatar fetches running at the same time
+            static int maxConcurrentFetches();
+            static void setMaxConcurrentFetches(int newMax);
+            /// The number of avatar fetches waiting in the queue
+            static int queuedFetchesCount();
+
             bool upload(Connection* connection, const QString& fileName,
                         upload_callback_t callback) const;
             bool upload(Connection* connection, QIODevice* source,
@@ -53,9 +81,33 @@ namespace QMatrixClient
             QString mediaId() const;
             QUrl url() const;
             bool updateUrl(const QUrl& newUrl);
+            /// The memory taken by decoded images of this avatar
+            qint64 decodedBytes() const;
+
+            /** The limit on memory taken by decoded avatar images
+             * Images are shared among all Avatar objects with the same URL
+             * in the process. When their total size exceeds the budget,
+             * images of the least recently used avatars are dropped, to be
+             * loaded again from the media cache when needed.
+             */
+            static qint64 memoryBudget();
+            static void setMemoryBudget(qint64 bytes);
+            /// The memory currently taken by decoded avatar images
+            static qint64 memoryUsage();
+            /** Drop scaled images of all avatars in the process
+             * \return the number of bytes freed
+             */
+            static qint64 dropScaledImages();
+            /** Drop all decoded avatar images in the process
+             * Images being decoded or scaled at the moment are kept. The
+             * dropped images are loaded again from the media cache on
+             * the next get().
+             * \return the number of bytes freed
+             */
+            static qint64 dropDecodedImages();
 
         private:
             class Private;
-            std::unique_ptr<Private> d;
+            std::shared_ptr<Private> d;
     };
 }  // namespace QMatrixClient
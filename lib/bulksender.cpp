@@ -0,0 +1,289 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "bulksender.h"
+
+#include "connection.h"
+#include "csapi/room_send.h"
+#include "events/roommessageevent.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+
+#include <deque>
+#include <memory>
+
+using namespace QMatrixClient;
+
+class BulkSender::Private
+{
+    public:
+        struct Item
+        {
+            QString txnId;
+            QString matrixType;
+            QJsonObject content;
+        };
+        struct RoomQueue
+        {
+            std::deque<Item> items;
+            int inFlight = 0;
+        };
+
+        Private(BulkSender* q, Connection* c) : q(q), connection(c) { }
+
+        BulkSender* q;
+        Connection* connection;
+
+        int maxInFlight = 10;
+        int maxInFlightPerRoom = 1;
+        int queueCapacity = 1000;
+
+        QHash<QString, RoomQueue> queues;
+        // Rooms that have something in the queue, in the order of serving
+        std::deque<QString> readyRooms;
+        int queued = 0;
+        int inFlight = 0;
+        bool saturated = false;
+
+        int sent = 0;
+        int failed = 0;
+        // Throughput is measured over the current busy period
+        QElapsedTimer busyTimer;
+        int sentInBusyPeriod = 0;
+
+        void dispatch();
+        void sendNext(const QString& roomId, RoomQueue& roomQueue);
+        /// \p job is nullptr if the job was abandoned before finishing
+        void finishSending(const QString& roomId, const QString& txnId,
+                           SendMessageJob* job);
+        void checkBackPressure();
+};
+
+void BulkSender::Private::dispatch()
+{
+    // Serve rooms round-robin; a room that already has as many requests
+    // in flight as allowed is skipped until one of them finishes.
+    auto roomsToTry = readyRooms.size();
+    while (inFlight < maxInFlight && roomsToTry > 0)
+    {
+        const auto roomId = readyRooms.front();
+        readyRooms.pop_front();
+        auto& roomQueue = queues[roomId];
+        if (roomQueue.inFlight >= maxInFlightPerRoom)
+        {
+            readyRooms.push_back(roomId);
+            --roomsToTry;
+            continue;
+        }
+        sendNext(roomId, roomQueue);
+        if (!roomQueue.items.empty())
+            readyRooms.push_back(roomId);
+        roomsToTry = readyRooms.size();
+    }
+}
+
+void BulkSender::Private::sendNext(const QString& roomId,
+                                   RoomQueue& roomQueue)
+{
+    auto item = std::move(roomQueue.items.front());
+    roomQueue.items.pop_front();
+    --queued;
+    ++roomQueue.inFlight;
+    ++inFlight;
+
+    auto* job = connection->callApi<SendMessageJob>(BackgroundRequest,
+                    roomId, item.matrixType, item.txnId, item.content);
+    // Rate limiting (429) is retried inside the job, honouring the delay
+    // suggested by the server; result() only comes after that.
+    const auto txnId = item.txnId;
+    const auto done = std::make_shared<bool>(false);
+    connect(job, &BaseJob::result, q, [this,roomId,txnId,job,done] {
+        *done = true;
+        finishSending(roomId, txnId, job);
+    });
+    // BaseJob::abandon() disconnects everything from the job before it
+    // finishes, so a child object is used to learn that the job is gone
+    connect(new QObject(job), &QObject::destroyed, q,
+            [this,roomId,txnId,done] {
+                if (!*done)
+                    finishSending(roomId, txnId, nullptr);
+            });
+}
+
+void BulkSender::Private::finishSending(const QString& roomId,
+                                        const QString& txnId,
+                                        SendMessageJob* job)
+{
+    --inFlight;
+    auto qIt = queues.find(roomId);
+    Q_ASSERT(qIt != queues.end());
+    --qIt->inFlight;
+    if (qIt->inFlight == 0 && qIt->items.empty())
+        queues.erase(qIt);
+
+    if (!job)
+    {
+        ++failed;
+        qCWarning(MAIN) << "BulkSender: sending" << txnId << "to" << roomId
+                        << "was abandoned";
+        emit q->eventFailed(roomId, txnId,
+                            QStringLiteral("The request was abandoned"));
+    } else if (job->error() == BaseJob::Success)
+    {
+        ++sent;
+        ++sentInBusyPeriod;
+        emit q->eventSent(roomId, txnId, job->eventId());
+    } else {
+        ++failed;
+        qCWarning(MAIN) << "BulkSender: failed to send" << txnId << "to"
+                        << roomId << "-" << job->status();
+        emit q->eventFailed(roomId, txnId, job->errorString());
+    }
+    checkBackPressure();
+    dispatch();
+    if (q->isIdle())
+    {
+        qCDebug(PROFILER) << "BulkSender: sent" << sentInBusyPeriod
+                          << "event(s) in" << busyTimer;
+        emit q->finished();
+    }
+}
+
+void BulkSender::Private::checkBackPressure()
+{
+    if (!saturated && queued >= queueCapacity)
+    {
+        saturated = true;
+        emit q->saturated();
+    }
+    else if (saturated && queued <= queueCapacity / 2)
+    {
+        saturated = false;
+        emit q->readyForMore();
+    }
+}
+
+BulkSender::BulkSender(Connection* connection)
+    : QObject(connection), d(std::make_unique<Private>(this, connection))
+{ }
+
+BulkSender::~BulkSender() = default;
+
+Connection* BulkSender::connection() const
+{
+    return d->connection;
+}
+
+QString BulkSender::enqueue(const QString& roomId, const QString& matrixType,
+                            const QJsonObject& content)
+{
+    if (isIdle())
+    {
+        d->busyTimer.start();
+        d->sentInBusyPeriod = 0;
+    }
+    QString txnId = d->connection->generateTxnId();
+    auto& roomQueue = d->queues[roomId];
+    if (roomQueue.items.empty())
+        d->readyRooms.push_back(roomId);
+    roomQueue.items.push_back({ txnId, matrixType, content });
+    ++d->queued;
+    d->checkBackPressure();
+    d->dispatch();
+    return txnId;
+}
+
+QString BulkSender::enqueueMessage(const QString& roomId,
+                                   const QJsonObject& content)
+{
+    return enqueue(roomId, RoomMessageEvent::matrixTypeId(), content);
+}
+
+int BulkSender::maxInFlight() const
+{
+    return d->maxInFlight;
+}
+
+void BulkSender::setMaxInFlight(int newMax)
+{
+    d->maxInFlight = std::max(newMax, 1);
+    d->dispatch();
+}
+
+int BulkSender::maxInFlightPerRoom() const
+{
+    return d->maxInFlightPerRoom;
+}
+
+void BulkSender::setMaxInFlightPerRoom(int newMax)
+{
+    d->maxInFlightPerRoom = std::max(newMax, 1);
+    d->dispatch();
+}
+
+int BulkSender::queueCapacity() const
+{
+    return d->queueCapacity;
+}
+
+void BulkSender::setQueueCapacity(int newCapacity)
+{
+    d->queueCapacity = std::max(newCapacity, 1);
+    d->checkBackPressure();
+}
+
+bool BulkSender::isSaturated() const
+{
+    return d->queued >= d->queueCapacity;
+}
+
+bool BulkSender::isIdle() const
+{
+    return d->queued == 0 && d->inFlight == 0;
+}
+
+BulkSender::Stats BulkSender::stats() const
+{
+    Stats s;
+    s.queued = d->queued;
+    s.inFlight = d->inFlight;
+    s.sent = d->sent;
+    s.failed = d->failed;
+    const auto elapsed = d->busyTimer.isValid() ? d->busyTimer.elapsed() : 0;
+    if (elapsed > 0)
+        s.eventsPerSecond = d->sentInBusyPeriod * 1000.0 / elapsed;
+    return s;
+}
+
+void BulkSender::clearQueue()
+{
+    for (auto it = d->queues.begin(); it != d->queues.end();)
+    {
+        it->items.clear();
+        if (it->inFlight == 0)
+            it = d->queues.erase(it);
+        else
+            ++it;
+    }
+    d->readyRooms.clear();
+    d->queued = 0;
+    d->checkBackPressure();
+    if (isIdle())
+        emit finished();
+}
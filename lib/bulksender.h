@@ -0,0 +1,112 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtCore/QJsonObject>
+
+#include <memory>
+
+namespace QMatrixClient
+{
+    class Connection;
+
+    /** A queue to send many events to many rooms at a controlled pace
+     *
+     * BulkSender is meant for bots and other clients that post a lot of
+     * events without looking at the timeline. Events are sent in the order
+     * they are enqueued within each room, while rooms are served
+     * round-robin so that one busy room doesn't starve the others.
+     * The number of requests in flight is limited both globally and per
+     * room; once the queue reaches its capacity, saturated() is emitted
+     * and the producer is expected to hold on until readyForMore().
+     *
+     * Use Connection::bulkSender() to get the instance for a connection.
+     */
+    class BulkSender : public QObject
+    {
+            Q_OBJECT
+            Q_PROPERTY(int maxInFlight READ maxInFlight WRITE setMaxInFlight)
+            Q_PROPERTY(int maxInFlightPerRoom READ maxInFlightPerRoom WRITE setMaxInFlightPerRoom)
+            Q_PROPERTY(int queueCapacity READ queueCapacity WRITE setQueueCapacity)
+        public:
+            struct Stats
+            {
+                int queued = 0;
+                int inFlight = 0;
+                int sent = 0;
+                int failed = 0;
+                /// Average rate of successfully sent events since the sender
+                /// last went busy after being idle
+                double eventsPerSecond = 0;
+            };
+
+            explicit BulkSender(Connection* connection);
+            ~BulkSender() override;
+
+            Connection* connection() const;
+
+            /** Queue an event for sending
+             * \return the transaction id of the event; it is passed to
+             *         eventSent() and eventFailed() later on. The event is
+             *         queued even when the sender is saturated.
+             */
+            Q_INVOKABLE QString enqueue(const QString& roomId,
+                                        const QString& matrixType,
+                                        const QJsonObject& content);
+            /// Queue an m.room.message event with the given content
+            Q_INVOKABLE QString enqueueMessage(const QString& roomId,
+                                               const QJsonObject& content);
+
+            int maxInFlight() const;
+            void setMaxInFlight(int newMax);
+            /** The number of requests per room that may run in parallel
+             * The default of 1 keeps events in each room strictly in
+             * the order of enqueue() calls; larger values trade this
+             * guarantee for throughput.
+             */
+            int maxInFlightPerRoom() const;
+            void setMaxInFlightPerRoom(int newMax);
+            int queueCapacity() const;
+            void setQueueCapacity(int newCapacity);
+
+            /// Whether the number of queued events reached queueCapacity()
+            bool isSaturated() const;
+            bool isIdle() const;
+            Stats stats() const;
+
+        public slots:
+            /// Drop all events that haven't been sent yet
+            void clearQueue();
+
+        signals:
+            /// The queue reached its capacity; stop enqueueing events
+            void saturated();
+            /// The queue drained to half of its capacity after saturated()
+            void readyForMore();
+            void eventSent(QString roomId, QString txnId, QString eventId);
+            void eventFailed(QString roomId, QString txnId, QString error);
+            /// All queued events have been either sent or failed
+            void finished();
+
+        private:
+            class Private;
+            std::unique_ptr<Private> d;
+    };
+}  // namespace QMatrixClient
@@ -22,6 +22,9 @@
 #include "events/directchatevent.h"
 #include "events/eventloader.h"
 #include "room.h"
+#include "bulksender.h"
+#include "downloadmanager.h"
+#include "stringpool.h"
 #include "settings.h"
 #include "csapi/login.h"
 #include "csapi/logout.h"
@@ -35,6 +38,7 @@
 #include "jobs/mediathumbnailjob.h"
 #include "jobs/downloadfilejob.h"
 #include "csapi/voip.h"
+#include "csapi/filter.h"
 
 #include <QtNetwork/QDnsLookup>
 #include <QtCore/QFile>
@@ -44,6 +48,11 @@
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QCoreApplication>
+#include <QtCore/QPointer>
+
+#include <deque>
+#include <vector>
+#include <algorithm>
 
 using namespace QMatrixClient;
 
@@ -64,6 +73,55 @@ HashT erase_if(HashT& hashMap, Pred pred)
     return removals;
 }
 
+static QJsonObject makeSyncFilterJson(const SyncFilterConfig& config)
+{
+    QJsonObject timelineFilter {
+        { QStringLiteral("limit"), config.timelineLimit }
+    };
+    QJsonObject stateFilter;
+    if (config.lazyLoadMembers)
+    {
+        timelineFilter.insert(QStringLiteral("lazy_load_members"), true);
+        stateFilter.insert(QStringLiteral("lazy_load_members"), true);
+    }
+    QJsonObject roomFilter;
+    QJsonObject filter;
+    if (!config.excludedEventTypes.isEmpty())
+    {
+        const auto notTypes =
+                QJsonArray::fromStringList(config.excludedEventTypes);
+        const QJsonObject notTypesFilter {
+            { QStringLiteral("not_types"), notTypes }
+        };
+        timelineFilter.insert(QStringLiteral("not_types"), notTypes);
+        stateFilter.insert(QStringLiteral("not_types"), notTypes);
+        roomFilter.insert(QStringLiteral("ephemeral"), notTypesFilter);
+        roomFilter.insert(QStringLiteral("account_data"), notTypesFilter);
+        filter.insert(QStringLiteral("account_data"), notTypesFilter);
+        filter.insert(QStringLiteral("presence"), notTypesFilter);
+    }
+    roomFilter.insert(QStringLiteral("timeline"), timelineFilter);
+    if (!stateFilter.isEmpty())
+        roomFilter.insert(QStringLiteral("state"), stateFilter);
+    filter.insert(QStringLiteral("room"), roomFilter);
+    return filter;
+}
+
+/** A DefineFilterJob that uploads the filter JSON as is
+ *
+ * Filter definitions generated from the API description can't convey
+ * lazy_load_members (and lose event type lists in room event filters).
+ */
+class DefineSyncFilterJob : public DefineFilterJob
+{
+    public:
+        DefineSyncFilterJob(const QString& userId, const QJsonObject& filter)
+            : DefineFilterJob(userId, {})
+        {
+            setRequestData(Data(filter));
+        }
+};
+
 class Connection::Private
 {
     public:
@@ -83,13 +141,61 @@ class Connection::Private
         QHash<QPair<QString, bool>, Room*> roomMap;
         QVector<QString> roomIdsToForget;
         QVector<Room*> firstTimeRooms;
-        QMap<QString, User*> userMap;
+        /// Users keyed by their ids interned in idPool
+        QHash<QString, User*> userMap;
+        StringPool idPool;
         DirectChatsMap directChats;
         DirectChatUsersMap directChatUsers;
         std::unordered_map<QString, EventPtr> accountData;
         QString userId;
 
         SyncJob* syncJob = nullptr;
+        int syncTimeout = -1;
+        bool syncPipelining = false;
+        bool compactEventStorage = false;
+        bool syncStopped = true;
+        bool applyingSync = false;
+        // Sync batches received from the server but not yet applied; only
+        // pipelined sync can get more than one batch here
+        std::deque<SyncData> syncBacklog;
+        // The next_batch token of the most recently received batch while
+        // it or any batches before it are still being applied
+        QString lastReceivedBatch;
+
+        SyncFilterConfig syncFilterConfig;
+        QJsonObject syncFilterJson = makeSyncFilterJson(syncFilterConfig);
+        QString syncFilterId;
+        bool syncFilterCacheChecked = false;
+        QPointer<DefineSyncFilterJob> defineFilterJob;
+        /// Failed uploads of the filter in a row; the inline filter is
+        /// used while waiting to retry
+        int filterUploadFailures = 0;
+        QElapsedTimer filterRetryTimer;
+
+        BulkSender* bulkSender = nullptr;
+
+        struct TransferProgress
+        {
+            QPointer<BaseJob> job;
+            qint64 done = 0;
+            qint64 total = -1;
+        };
+        std::vector<TransferProgress> transfers;
+        // Both below are reset when transfers start after being idle
+        QElapsedTimer transfersTimer;
+        qint64 finishedTransfersBytes = 0;
+        QElapsedTimer transferStatsTimer;
+
+        void trackTransfer(BaseJob* job);
+        void pruneTransfers();
+        void notifyTransferStats(bool force);
+        DownloadManager* downloadManager = nullptr;
+
+        qint64 memoryUsageThreshold = 0;
+        bool memoryUsageAboveThreshold = false;
+        QElapsedTimer memoryCheckTimer;
+
+        void checkMemoryUsage();
 
         bool cacheState = true;
         bool cacheToBinary = SettingsGroup("libqmatrixclient")
@@ -100,6 +206,28 @@ class Connection::Private
         void broadcastDirectChatUpdates(const DirectChatsMap& additions,
                                         const DirectChatsMap& removals);
 
+        QString syncFilterFileName() const
+        {
+            return q->stateCachePath() % "sync_filter.json";
+        }
+        QString syncFilter();
+        void uploadSyncFilter();
+        void resetFilterRetries()
+        {
+            filterUploadFailures = 0;
+            filterRetryTimer.invalidate();
+        }
+
+        void continueSync()
+        {
+            // Don't request more if the backlog already grows faster than
+            // it is applied
+            static constexpr size_t MaxSyncBacklog = 2;
+            if (syncPipelining && !syncStopped && !syncJob
+                    && syncBacklog.size() < MaxSyncBacklog)
+                q->sync(syncTimeout);
+        }
+
         template <typename EventT>
         EventT* unpackAccountData() const
         {
@@ -130,6 +258,10 @@ Connection::Connection(const QUrl& server, QObject* parent)
     , d(std::make_unique<Private>(std::make_unique<ConnectionData>(server)))
 {
     d->q = this; // All d initialization should occur before this line
+    // Snapshots are meant to be passed to other threads, queued
+    // connections included
+    qRegisterMetaType<RoomStateSnapshot>();
+    qRegisterMetaType<TimelineSnapshot>();
 }
 
 Connection::Connection(QObject* parent)
@@ -139,6 +271,12 @@ Connection::Connection(QObject* parent)
 Connection::~Connection()
 {
     qCDebug(MAIN) << "deconstructing connection object for" << d->userId;
+    // Rooms are deleted after the connection; they can't send anything then
+    for (auto* r: qAsConst(d->roomMap))
+    {
+        r->d->readMarkersTimer.stop();
+        r->d->flushOutbox();
+    }
     stopSync();
 }
 
@@ -243,6 +381,8 @@ void Connection::Private::connectWithToken(const QString& user,
     q->user(); // Creates a User object for the local user
     data->setToken(accessToken.toLatin1());
     data->setDeviceId(deviceId);
+    // A new session gives the server another chance to take the filter
+    resetFilterRetries();
     qCDebug(MAIN) << "Using server" << data->baseUrl().toDisplayString()
                   << "by user" << userId << "from device" << deviceId;
     emit q->stateChanged();
@@ -284,18 +424,42 @@ void Connection::logout()
 
 void Connection::sync(int timeout)
 {
+    d->syncStopped = false;
     if (d->syncJob)
         return;
 
-    // Raw string: http://en.cppreference.com/w/cpp/language/string_literal
-    const auto filter =
-        QStringLiteral(R"({"room": { "timeline": { "limit": 100 } } })");
-    auto job = d->syncJob = callApi<SyncJob>(BackgroundRequest,
-                                         d->data->lastEvent(), filter, timeout);
+    d->syncTimeout = timeout;
+    const auto filter = d->syncFilter();
+    // lastEvent() only moves forward once a batch is applied; if there are
+    // batches still being applied, continue from the latest received one.
+    const auto& since = d->lastReceivedBatch.isEmpty()
+                        ? d->data->lastEvent() : d->lastReceivedBatch;
+    auto job = d->syncJob =
+            callApi<SyncJob>(BackgroundRequest, since, filter, timeout);
     connect( job, &SyncJob::success, this, [this, job] {
-        onSyncSuccess(job->takeData());
         d->syncJob = nullptr;
-        emit syncDone();
+        d->syncBacklog.push_back(job->takeData());
+        d->lastReceivedBatch = d->syncBacklog.back().nextBatch();
+        d->continueSync();
+        // onSyncSuccess() processes events, so another batch may arrive
+        // while this one is being applied; it will be picked up by the loop
+        // below instead of being applied out of order.
+        if (d->applyingSync)
+            return;
+
+        d->applyingSync = true;
+        while (!d->syncBacklog.empty())
+        {
+            auto data = std::move(d->syncBacklog.front());
+            d->syncBacklog.pop_front();
+            d->continueSync();
+            onSyncSuccess(std::move(data));
+            emit syncDone();
+        }
+        d->applyingSync = false;
+        d->lastReceivedBatch.clear();
+        d->continueSync();
+        d->checkMemoryUsage();
     });
     connect( job, &SyncJob::retryScheduled, this,
         [this,job] (int retriesTaken, int nextInMilliseconds)
@@ -305,6 +469,7 @@ void Connection::sync(int timeout)
         });
     connect( job, &SyncJob::failure, this, [this, job] {
         d->syncJob = nullptr;
+        d->syncStopped = true; // Leave it to the client to restart syncing
         if (job->error() == BaseJob::ContentAccessError)
         {
             qCWarning(SYNCJOB)
@@ -316,6 +481,75 @@ void Connection::sync(int timeout)
     });
 }
 
+QString Connection::Private::syncFilter()
+{
+    if (syncFilterId.isEmpty() && !syncFilterCacheChecked && cacheState)
+    {
+        syncFilterCacheChecked = true;
+        QFile filterFile { syncFilterFileName() };
+        if (filterFile.open(QFile::ReadOnly))
+        {
+            const auto cached =
+                    QJsonDocument::fromJson(filterFile.readAll()).object();
+            if (cached.value("filter"_ls).toObject() == syncFilterJson)
+                syncFilterId = cached.value("filter_id"_ls).toString();
+        }
+    }
+    if (!syncFilterId.isEmpty())
+        return syncFilterId;
+
+    // Keep syncing with the inline filter until the server assigns an id;
+    // after a failure, wait 1, 2, 4... up to 64 minutes before retrying
+    const auto retryDelay =
+        60000LL << std::min(std::max(filterUploadFailures - 1, 0), 6);
+    if (!isJobRunning(defineFilterJob) && (filterUploadFailures == 0
+            || filterRetryTimer.hasExpired(retryDelay)))
+        uploadSyncFilter();
+    return QString::fromUtf8(
+            QJsonDocument(syncFilterJson).toJson(QJsonDocument::Compact));
+}
+
+void Connection::Private::uploadSyncFilter()
+{
+    const auto filterJson = syncFilterJson;
+    auto* job = q->callApi<DefineSyncFilterJob>(BackgroundRequest,
+                                                userId, filterJson);
+    defineFilterJob = job;
+    QObject::connect(job, &BaseJob::failure, q, [this, job, filterJson] {
+        if (filterJson != syncFilterJson)
+            return;
+        ++filterUploadFailures;
+        filterRetryTimer.start();
+        qCWarning(MAIN) << "Couldn't define the sync filter for" << userId
+                        << "-" << job->errorString()
+                        << "; using the inline filter for now";
+    });
+    QObject::connect(job, &BaseJob::success, q, [this, job, filterJson] {
+        if (filterJson != syncFilterJson)
+            return; // The configuration has changed since the upload
+
+        resetFilterRetries();
+        syncFilterId = job->filterId();
+        qCDebug(MAIN) << "Sync filter for" << userId << "defined with id"
+                      << syncFilterId;
+        if (!cacheState)
+            return;
+
+        QFile filterFile { syncFilterFileName() };
+        if (filterFile.open(QFile::WriteOnly))
+        {
+            const QJsonObject cached {
+                { QStringLiteral("filter"), filterJson },
+                { QStringLiteral("filter_id"), syncFilterId }
+            };
+            filterFile.write(
+                    QJsonDocument(cached).toJson(QJsonDocument::Compact));
+        } else
+            qCWarning(MAIN) << "Error opening" << filterFile.fileName()
+                            << ":" << filterFile.errorString();
+    });
+}
+
 void Connection::onSyncSuccess(SyncData &&data, bool fromCache) {
     d->data->setLastEvent(data.nextBatch());
     for (auto&& roomData: data.takeRoomData())
@@ -404,6 +638,7 @@ void Connection::onSyncSuccess(SyncData &&data, bool fromCache) {
 
 void Connection::stopSync()
 {
+    d->syncStopped = true;
     if (d->syncJob)
     {
         d->syncJob->abandon();
@@ -413,7 +648,9 @@ void Connection::stopSync()
 
 PostReceiptJob* Connection::postReceipt(Room* room, RoomEvent* event) const
 {
-    return callApi<PostReceiptJob>(room->id(), "m.read", event->id());
+    // Sent right away, but through the room so that coalesced receipts
+    // don't override it with an older one
+    return room->d->sendReceipt(event->id());
 }
 
 JoinRoomJob* Connection::joinRoom(const QString& roomAlias,
@@ -459,10 +696,93 @@ MediaThumbnailJob* Connection::getThumbnail(const QUrl& url,
     return getThumbnail(url, QSize(requestedWidth, requestedHeight), policy);
 }
 
+void Connection::Private::trackTransfer(BaseJob* job)
+{
+    pruneTransfers();
+    if (transfers.empty())
+    {
+        transfersTimer.start();
+        finishedTransfersBytes = 0;
+    }
+    transfers.push_back({ job });
+    const auto updateProgress = [this,job] (qint64 done, qint64 total) {
+        auto it = std::find_if(transfers.begin(), transfers.end(),
+                          [job] (const TransferProgress& t) {
+                              return t.job == job;
+                          });
+        if (it == transfers.end())
+            return;
+        it->done = done;
+        it->total = total;
+        notifyTransferStats(false);
+    };
+    QObject::connect(job, &BaseJob::downloadProgress, q, updateProgress);
+    QObject::connect(job, &BaseJob::uploadProgress, q, updateProgress);
+    QObject::connect(job, &BaseJob::finished, q, [this,job] {
+        auto it = std::find_if(transfers.begin(), transfers.end(),
+                          [job] (const TransferProgress& t) {
+                              return t.job == job;
+                          });
+        if (it != transfers.end())
+        {
+            finishedTransfersBytes += it->done;
+            transfers.erase(it);
+        }
+        notifyTransferStats(true);
+    });
+}
+
+void Connection::Private::pruneTransfers()
+{
+    // Abandoned jobs don't notify about finishing; drop them once deleted
+    transfers.erase(std::remove_if(transfers.begin(), transfers.end(),
+                        [] (const TransferProgress& t) { return !t.job; }),
+                    transfers.end());
+}
+
+void Connection::Private::notifyTransferStats(bool force)
+{
+    static constexpr qint64 MinInterval = 250; // ms
+    if (force || !transferStatsTimer.isValid()
+            || transferStatsTimer.elapsed() >= MinInterval)
+    {
+        transferStatsTimer.start();
+        emit q->transferStatsChanged();
+    }
+}
+
+TransferStats Connection::transferStats() const
+{
+    d->pruneTransfers();
+    TransferStats stats;
+    stats.activeTransfers = int(d->transfers.size());
+    qint64 bytesDoneOfKnownSize = 0;
+    for (const auto& t: d->transfers)
+    {
+        stats.bytesDone += t.done;
+        if (t.total > 0)
+        {
+            stats.bytesTotal += t.total;
+            bytesDoneOfKnownSize += t.done;
+        }
+    }
+    if (stats.activeTransfers > 0 && d->transfersTimer.elapsed() > 0)
+        stats.bytesPerSecond =
+            double(d->finishedTransfersBytes + stats.bytesDone) * 1000
+            / d->transfersTimer.elapsed();
+    if (stats.bytesPerSecond > 0 && stats.bytesTotal > 0)
+        stats.etaMs = qint64((stats.bytesTotal - bytesDoneOfKnownSize) * 1000
+                             / stats.bytesPerSecond);
+    return stats;
+}
+
 UploadContentJob* Connection::uploadContent(QIODevice* contentSource,
         const QString& filename, const QString& contentType) const
 {
-    return callApi<UploadContentJob>(contentSource, filename, contentType);
+    auto* job =
+        callApi<UploadContentJob>(contentSource, filename, contentType);
+    d->trackTransfer(job);
+    return job;
 }
 
 UploadContentJob* Connection::uploadFile(const QString& fileName,
@@ -482,7 +802,9 @@ UploadContentJob* Connection::uploadFile(const QString& fileName,
 GetContentJob* Connection::getContent(const QString& mediaId) const
 {
     auto idParts = splitMediaId(mediaId);
-    return callApi<GetContentJob>(idParts.front(), idParts.back());
+    auto* job = callApi<GetContentJob>(idParts.front(), idParts.back());
+    d->trackTransfer(job);
+    return job;
 }
 
 GetContentJob* Connection::getContent(const QUrl& url) const
@@ -497,6 +819,7 @@ DownloadFileJob* Connection::downloadFile(const QUrl& url,
     auto idParts = splitMediaId(mediaId);
     auto* job = callApi<DownloadFileJob>(idParts.front(), idParts.back(),
                                          localFilename);
+    d->trackTransfer(job);
     return job;
 }
 
@@ -653,6 +976,8 @@ ForgetRoomJob* Connection::forgetRoom(const QString& id)
                               << "in state" << toCString(r->joinState())
                               << "will be deleted";
                 emit r->beforeDestruction(r);
+                // Nothing will be sent to the forgotten room anymore
+                r->d->dropOutbox();
                 r->deleteLater();
             }
     });
@@ -678,6 +1003,94 @@ SendToDeviceJob* Connection::sendToDevices(const QString& eventType,
                 eventType, generateTxnId(), json);
 }
 
+BulkSender* Connection::bulkSender()
+{
+    if (!d->bulkSender)
+        d->bulkSender = new BulkSender(this);
+    return d->bulkSender;
+}
+
+DownloadManager* Connection::downloadManager()
+{
+    if (!d->downloadManager)
+        d->downloadManager = new DownloadManager(this);
+    return d->downloadManager;
+}
+
+void Connection::prefetchAvatars(const QVector<User*>& users, int dimension,
+                                 const Room* room)
+{
+    for (auto* u: users)
+        u->prefetchAvatar(dimension, room);
+}
+
+void Connection::prefetchAvatars(const QVector<Room*>& rooms, int dimension)
+{
+    for (auto* r: rooms)
+        r->prefetchAvatar(dimension);
+}
+
+MemoryTrimResult Connection::trimMemory(MemoryTrimLevel level)
+{
+    QElapsedTimer et; et.start();
+    MemoryTrimResult result;
+    result.scaledImages = Avatar::dropScaledImages();
+    if (level >= MemoryTrimLevel::DecodedImages)
+        result.decodedImages = Avatar::dropDecodedImages();
+    if (level >= MemoryTrimLevel::History)
+    {
+        for (auto* r: qAsConst(d->roomMap))
+            result.history += r->trimHistory();
+        d->idPool.purge();
+    }
+    if (level >= MemoryTrimLevel::HiddenRoomsState)
+        for (auto* r: qAsConst(d->roomMap))
+            if (!r->displayed())
+                result.hiddenRoomsState += r->unloadMembers();
+    qCDebug(PROFILER) << "*** Connection::trimMemory():" << result.total()
+                      << "bytes freed," << et;
+    return result;
+}
+
+MemoryUsage Connection::memoryUsage() const
+{
+    MemoryUsage usage;
+    for (const auto* r: qAsConst(d->roomMap))
+        usage += r->memoryUsage();
+    usage.avatars = Avatar::memoryUsage();
+    usage.arenaWaste = EventArena::unusedBytes();
+    return usage;
+}
+
+qint64 Connection::memoryUsageThreshold() const
+{
+    return d->memoryUsageThreshold;
+}
+
+void Connection::setMemoryUsageThreshold(qint64 bytes)
+{
+    d->memoryUsageThreshold = bytes;
+    d->memoryUsageAboveThreshold = false;
+    d->memoryCheckTimer.invalidate();
+    d->checkMemoryUsage();
+}
+
+void Connection::Private::checkMemoryUsage()
+{
+    if (memoryUsageThreshold <= 0 || (memoryCheckTimer.isValid()
+                                      && memoryCheckTimer.elapsed() < 10000))
+        return;
+    memoryCheckTimer.start();
+    const auto usage = q->memoryUsage().total();
+    const auto above = usage >= memoryUsageThreshold;
+    if (above == memoryUsageAboveThreshold)
+        return;
+    memoryUsageAboveThreshold = above;
+    qCDebug(MAIN) << "Memory usage of" << userId << "is" << usage
+                  << "bytes," << (above ? "above" : "below") << "the threshold";
+    emit q->memoryUsageThresholdCrossed(above, usage);
+}
+
 SendMessageJob* Connection::sendMessage(const QString& roomId,
                                         const RoomEvent& event) const
 {
@@ -717,6 +1130,9 @@ Room* Connection::invitation(const QString& roomId) const
 
 User* Connection::user(const QString& userId)
 {
+    const auto it = d->userMap.constFind(userId);
+    if (it != d->userMap.cend())
+        return *it;
     if (userId.isEmpty())
         return nullptr;
     if (!userId.startsWith('@') || !userId.contains(':'))
@@ -724,10 +1140,9 @@ User* Connection::user(const QString& userId)
         qCCritical(MAIN) << "Malformed userId:" << userId;
         return nullptr;
     }
-    if( d->userMap.contains(userId) )
-        return d->userMap.value(userId);
-    auto* user = userFactory()(this, userId);
-    d->userMap.insert(userId, user);
+    const auto pooledId = d->idPool.intern(userId);
+    auto* user = userFactory()(this, pooledId);
+    d->userMap.insert(pooledId, user);
     emit newUser(user);
     return user;
 }
@@ -772,6 +1187,11 @@ int Connection::millisToReconnect() const
     return d->syncJob ? d->syncJob->millisToRetry() : 0;
 }
 
+QString Connection::nextBatchToken() const
+{
+    return d->data->lastEvent();
+}
+
 QHash< QPair<QString, bool>, Room* > Connection::roomMap() const
 {
     // Copy-on-write-and-remove-elements is faster than copying elements one by one.
@@ -958,7 +1378,11 @@ void Connection::removeFromIgnoredUsers(const User* user)
 
 QMap<QString, User*> Connection::users() const
 {
-    return d->userMap;
+    // Sorted on demand; the keys share data with the pooled ids
+    QMap<QString, User*> result;
+    for (auto it = d->userMap.cbegin(); it != d->userMap.cend(); ++it)
+        result.insert(it.key(), it.value());
+    return result;
 }
 
 const ConnectionData* Connection::connectionData() const
@@ -1181,6 +1605,55 @@ void Connection::setCacheState(bool newValue)
     }
 }
 
+bool Connection::syncPipelining() const
+{
+    return d->syncPipelining;
+}
+
+void Connection::setSyncPipelining(bool enable)
+{
+    d->syncPipelining = enable;
+}
+
+StringPool& Connection::idPool()
+{
+    return d->idPool;
+}
+
+bool Connection::compactEventStorage() const
+{
+    return d->compactEventStorage;
+}
+
+void Connection::setCompactEventStorage(bool enable)
+{
+    if (d->compactEventStorage == enable)
+        return;
+    d->compactEventStorage = enable;
+    if (enable)
+        for (auto* r: qAsConst(d->roomMap))
+            r->compactEvents();
+}
+
+SyncFilterConfig Connection::syncFilter() const
+{
+    return d->syncFilterConfig;
+}
+
+void Connection::setSyncFilter(const SyncFilterConfig& config)
+{
+    if (d->syncFilterConfig == config)
+        return;
+
+    d->syncFilterConfig = config;
+    d->syncFilterJson = makeSyncFilterJson(config);
+    d->syncFilterId.clear();
+    d->syncFilterCacheChecked = false;
+    d->resetFilterRetries();
+    if (d->defineFilterJob)
+        d->defineFilterJob->abandon();
+}
+
 void Connection::getTurnServers()
 {
   auto job = callApi<GetTurnServerJob>();
@@ -48,6 +48,10 @@ namespace QMatrixClient
     class DownloadFileJob;
     class SendToDeviceJob;
     class SendMessageJob;
+    class BulkSender;
+    class DownloadManager;
+    class StringPool;
+    struct MemoryUsage;
 
     /** Create a single-shot connection that triggers on the signal and
      * then self-disconnects
@@ -110,6 +114,73 @@ namespace QMatrixClient
      */
     enum RunningPolicy { ForegroundRequest = 0x0, BackgroundRequest = 0x1 };
 
+    /** High-level parameters of the server-side filter used by /sync
+     *
+     * \sa Connection::setSyncFilter
+     */
+    struct SyncFilterConfig
+    {
+        /// The maximal number of timeline events per room in a sync batch
+        int timelineLimit = 100;
+        /** Only receive member events needed to display the timeline
+         *
+         * The full member list of a room can then be loaded on demand.
+         */
+        bool lazyLoadMembers = false;
+        /// Event types (wildcards allowed) to exclude from sync responses
+        QStringList excludedEventTypes;
+
+        bool operator==(const SyncFilterConfig& other) const
+        {
+            return timelineLimit == other.timelineLimit &&
+                    lazyLoadMembers == other.lazyLoadMembers &&
+                    excludedEventTypes == other.excludedEventTypes;
+        }
+        bool operator!=(const SyncFilterConfig& other) const
+        {
+            return !operator==(other);
+        }
+    };
+
+    /// Aggregate progress of media uploads and downloads on a connection
+    struct TransferStats
+    {
+        int activeTransfers = 0;
+        qint64 bytesDone = 0;
+        /// Only includes transfers that reported their total size
+        qint64 bytesTotal = 0;
+        /// Average speed since the transfers started after being idle
+        double bytesPerSecond = 0;
+        /// Estimated time to complete the transfers, or -1 if unknown
+        qint64 etaMs = -1;
+    };
+
+    /** How much memory Connection::trimMemory() should free
+     *
+     * Each level also includes all the levels before it.
+     */
+    enum class MemoryTrimLevel
+    {
+        ScaledImages = 1, ///< Avatar images scaled to requested sizes
+        DecodedImages, ///< All decoded avatar images
+        History, ///< Room timelines beyond the read marker
+        HiddenRoomsState, ///< Lazy-loadable state of non-displayed rooms
+    };
+
+    /// Bytes freed by Connection::trimMemory(), by level
+    struct MemoryTrimResult
+    {
+        qint64 scaledImages = 0;
+        qint64 decodedImages = 0;
+        qint64 history = 0;
+        qint64 hiddenRoomsState = 0;
+
+        qint64 total() const
+        {
+            return scaledImages + decodedImages + history + hiddenRoomsState;
+        }
+    };
+
     class Connection: public QObject {
             Q_OBJECT
 
@@ -122,6 +193,8 @@ namespace QMatrixClient
             Q_PROPERTY(QByteArray accessToken READ accessToken NOTIFY stateChanged)
             Q_PROPERTY(QUrl homeserver READ homeserver WRITE setHomeserver NOTIFY homeserverChanged)
             Q_PROPERTY(bool cacheState READ cacheState WRITE setCacheState NOTIFY cacheStateChanged)
+            Q_PROPERTY(bool syncPipelining READ syncPipelining WRITE setSyncPipelining)
+            Q_PROPERTY(bool compactEventStorage READ compactEventStorage WRITE setCompactEventStorage)
         public:
             // Room ids, rather than room pointers, are used in the direct chat
             // map types because the library keeps Invite rooms separate from
@@ -253,7 +326,10 @@ namespace QMatrixClient
              */
             void removeFromIgnoredUsers(const User* user);
 
-            /** Get the full list of users known to this account */
+            /** Get the full list of users known to this account
+             * The map is sorted anew on each call, so it's better to
+             * keep the result than to call this repeatedly.
+             */
             QMap<QString, User*> users() const;
 
             QUrl homeserver() const;
@@ -268,6 +344,11 @@ namespace QMatrixClient
             QByteArray accessToken() const;
             Q_INVOKABLE SyncJob* syncJob() const;
             Q_INVOKABLE int millisToReconnect() const;
+            /** The next_batch token of the latest sync batch applied to rooms
+             *
+             * This is the point in the history the room states correspond to.
+             */
+            Q_INVOKABLE QString nextBatchToken() const;
 
             [[deprecated("Use accessToken() instead")]]
             Q_INVOKABLE QString token() const;
@@ -308,6 +389,50 @@ namespace QMatrixClient
             bool cacheState() const;
             void setCacheState(bool newValue);
 
+            /** Whether the sync loop is pipelined
+             *
+             * In the pipelined mode, the next /sync request is sent as soon
+             * as the previous response is parsed, without waiting until
+             * rooms are updated with it; the connection keeps syncing
+             * on its own until stopSync() is called. Batches are still
+             * applied strictly one after another, each followed by
+             * syncDone(). Disabled by default.
+             * \sa sync, stopSync
+             */
+            bool syncPipelining() const;
+            void setSyncPipelining(bool enable);
+
+            /** Whether rooms store their events as compact JSON text
+             *
+             * Events in room timelines and state are then kept as their
+             * compact JSON, with only a few envelope fields decoded; the rest
+             * of the JSON is decoded when accessed. This takes several times
+             * less memory for large histories. Disabled by default.
+             * \sa Event::compact, Room::compactEvents
+             */
+            bool compactEventStorage() const;
+            void setCompactEventStorage(bool enable);
+
+            /** The table of interned user ids of this connection
+             * Ids of users, senders and state keys of room events and
+             * event ids of read receipts share their storage through
+             * this table.
+             * \sa RoomEvent::internIds
+             */
+            StringPool& idPool();
+
+            /** The configuration of the filter for /sync requests */
+            SyncFilterConfig syncFilter() const;
+            /** Change the filter for /sync requests
+             *
+             * The filter is uploaded to the server and subsequent sync()
+             * calls refer to it by its id; until the id is known, the filter
+             * definition is passed inline. Filter ids are cached on disk
+             * next to the state cache, so the filter is only uploaded again
+             * when its configuration changes.
+             */
+            void setSyncFilter(const SyncFilterConfig& config);
+
             /** Start a job of a specified type with specified arguments and policy
              *
              * This is a universal method to start a job of a type passed
@@ -484,6 +609,60 @@ namespace QMatrixClient
             SendToDeviceJob* sendToDevices(const QString& eventType,
                     const UsersToDevicesToEvents& eventsMap) const;
 
+            /** Get the queue for sending events in bulk
+             * The sender is created on the first call and is owned by
+             * the connection.
+             * \sa BulkSender
+             */
+            BulkSender* bulkSender();
+
+            /// Get the aggregate progress of ongoing file transfers
+            TransferStats transferStats() const;
+
+            /** Get the queue of media downloads for this connection
+             * The manager is created on the first call and is owned by
+             * the connection.
+             * \sa DownloadManager
+             */
+            DownloadManager* downloadManager();
+
+            /** Fetch avatars of \p users in advance
+             * Use this for users about to be shown, e.g. when the view
+             * is scrolled; the avatars are fetched with a lower priority
+             * than the ones actually requested for display.
+             * \sa Avatar::prefetch
+             */
+            void prefetchAvatars(const QVector<User*>& users, int dimension,
+                                 const Room* room = nullptr);
+            /// Fetch avatars of \p rooms in advance
+            void prefetchAvatars(const QVector<Room*>& rooms, int dimension);
+
+            /** Free memory, e.g. when the application goes to background
+             *
+             * Everything dropped is restored on demand: avatars are loaded
+             * from the media cache, history is requested from the server
+             * when scrolled to, and members are reloaded when the room
+             * is displayed again. Decoded avatars are shared by all
+             * connections in the process, so trimming them affects other
+             * connections too. Byte counts of events are estimated from
+             * the size of their JSON.
+             * \sa Room::trimHistory, Room::unloadMembers
+             */
+            MemoryTrimResult trimMemory(MemoryTrimLevel level);
+
+            /** Estimate the memory taken by the rooms of the connection
+             * This walks all the events in all rooms, so it's not cheap.
+             * The avatars and arena waste figures cover the whole process.
+             * \sa Room::memoryUsage
+             */
+            MemoryUsage memoryUsage() const;
+            qint64 memoryUsageThreshold() const;
+            /** Set the usage to notify about with memoryUsageThresholdCrossed()
+             * The usage is checked after syncs, not more often than every
+             * 10 seconds. 0 (the default) disables the checks.
+             */
+            void setMemoryUsageThreshold(qint64 bytes);
+
             /** \deprecated This method is experimental and may be removed any time */
             SendMessageJob* sendMessage(const QString& roomId,
                                         const RoomEvent& event) const;
@@ -546,6 +725,15 @@ namespace QMatrixClient
             void syncDone();
             void syncError(QString message, QString details);
 
+            /** The aggregate progress of file transfers has changed
+             * The signal is emitted at most 4 times a second while there are
+             * ongoing transfers, and once when they are all finished.
+             * \sa transferStats
+             */
+            void transferStatsChanged();
+            /// The memory usage has gone above or back below the threshold
+            void memoryUsageThresholdCrossed(bool above, qint64 usage);
+
             void newUser(User* user);
 
             /**
@@ -0,0 +1,287 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "downloadmanager.h"
+
+#include "connection.h"
+#include "mediacache.h"
+#include "jobs/downloadfilejob.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QPointer>
+#include <QtCore/QStringBuilder>
+#include <QtCore/QTimer>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+using namespace QMatrixClient;
+
+// A hard link saves both the time and the disk space a copy would take;
+// it's not always possible though (e.g., across file systems)
+static bool linkOrCopy(const QString& source, const QString& target)
+{
+#ifdef Q_OS_UNIX
+    if (::link(QFile::encodeName(source).constData(),
+               QFile::encodeName(target).constData()) == 0)
+        return true;
+#endif
+    return QFile::copy(source, target);
+}
+
+class DownloadManager::Private
+{
+    public:
+        struct Transfer
+        {
+            QUrl mxcUri;
+            /// The content is downloaded next to the media cache and moved
+            /// into it once complete
+            QString fileName;
+            Priority priority = Prefetch;
+            QPointer<DownloadFileJob> job;
+            std::vector<DownloadRequest*> requests;
+        };
+
+        Private(DownloadManager* q, Connection* c) : q(q), connection(c) { }
+
+        DownloadManager* q;
+        Connection* connection;
+        int maxConcurrentDownloads = 4;
+
+        /// Transfers, keyed by mxc URI
+        QHash<QString, Transfer> transfers;
+        /// Keys of transfers waiting to start, one queue per priority
+        std::deque<QString> queues[UserInitiated + 1];
+        int running = 0;
+
+        static QString defaultFileName(const QUrl& mxcUri)
+        {
+            return QDir::tempPath() % "/qmc-" % mxcUri.authority() % '_'
+                    % mxcUri.path().mid(1);
+        }
+
+        void dispatch();
+        void start(const QString& key, Transfer& transfer);
+        void finish(const QString& key, DownloadFileJob* job);
+        void deliver(const QString& fileName, DownloadRequest* r);
+        void cancel(DownloadRequest* request);
+};
+
+void DownloadManager::Private::dispatch()
+{
+    while (running < maxConcurrentDownloads)
+    {
+        auto queueIt = std::find_if(std::rbegin(queues), std::rend(queues),
+                [] (const std::deque<QString>& q) { return !q.empty(); });
+        if (queueIt == std::rend(queues))
+            return;
+        const auto key = queueIt->front();
+        queueIt->pop_front();
+        start(key, transfers[key]);
+    }
+}
+
+void DownloadManager::Private::start(const QString& key, Transfer& transfer)
+{
+    auto* job = connection->downloadFile(transfer.mxcUri, transfer.fileName);
+    transfer.job = job;
+    ++running;
+    connect(job, &BaseJob::downloadProgress, q,
+        [this,key] (qint64 received, qint64 total) {
+            for (auto* r: transfers.value(key).requests)
+                emit r->progress(received, total);
+        });
+    connect(job, &BaseJob::result, q, [this,key,job] { finish(key, job); });
+    qCDebug(JOBS) << "DownloadManager: started" << key << "with"
+                  << transfer.requests.size() << "request(s);"
+                  << running << "download(s) running";
+}
+
+void DownloadManager::Private::finish(const QString& key, DownloadFileJob* job)
+{
+    --running;
+    const auto transfer = transfers.take(key);
+    if (job->error() != BaseJob::Success)
+    {
+        for (auto* r: transfer.requests)
+        {
+            emit r->failed(job->errorString());
+            r->deleteLater();
+        }
+        dispatch();
+        return;
+    }
+    auto& cache = MediaCache::instance();
+    const bool cached = cache.commit(transfer.mxcUri);
+    const auto downloadedFileName =
+        cached ? cache.filePath(transfer.mxcUri) : job->targetFileName();
+    for (auto* r: transfer.requests)
+    {
+        // Requests that didn't ask for a file name get the cached file;
+        // content too large for the cache is moved out of the cache dir
+        if (r->_localFileName == transfer.fileName)
+            r->_localFileName = cached ? downloadedFileName
+                                       : defaultFileName(transfer.mxcUri);
+        deliver(downloadedFileName, r);
+    }
+    if (!cached)
+        QFile::remove(downloadedFileName);
+    dispatch();
+}
+
+void DownloadManager::Private::deliver(const QString& fileName,
+                                       DownloadRequest* r)
+{
+    if (r->_localFileName != fileName)
+    {
+        // The request asked for its own file name
+        QFile::remove(r->_localFileName);
+        if (!linkOrCopy(fileName, r->_localFileName))
+        {
+            qCWarning(MAIN) << "Couldn't copy" << fileName
+                            << "to" << r->_localFileName;
+            emit r->failed(tr("Couldn't save the file"));
+            r->deleteLater();
+            return;
+        }
+    }
+    emit r->completed(r->_localFileName);
+    r->deleteLater();
+}
+
+void DownloadManager::Private::cancel(DownloadRequest* request)
+{
+    const auto key = request->_mxcUri.toString();
+    auto tIt = transfers.find(key);
+    if (tIt == transfers.end())
+    {
+        // Already finished, or is being served from the cache
+        request->deleteLater();
+        return;
+    }
+    auto& requests = tIt->requests;
+    requests.erase(std::remove(requests.begin(), requests.end(), request),
+                   requests.end());
+    request->deleteLater();
+    if (!requests.empty())
+        return;
+
+    if (tIt->job)
+    {
+        tIt->job->abandon();
+        --running;
+    } else {
+        auto& queue = queues[tIt->priority];
+        queue.erase(std::remove(queue.begin(), queue.end(), key), queue.end());
+    }
+    transfers.erase(tIt);
+    dispatch();
+}
+
+DownloadRequest::DownloadRequest(QUrl mxcUri, QString localFileName,
+                                 DownloadManager* manager)
+    : QObject(manager), _manager(manager)
+    , _mxcUri(std::move(mxcUri)), _localFileName(std::move(localFileName))
+{ }
+
+void DownloadRequest::cancel()
+{
+    _manager->d->cancel(this);
+}
+
+DownloadManager::DownloadManager(Connection* connection)
+    : QObject(connection), d(std::make_unique<Private>(this, connection))
+{ }
+
+DownloadManager::~DownloadManager() = default;
+
+DownloadRequest* DownloadManager::download(const QUrl& mxcUri,
+                                           const QString& localFilename,
+                                           Priority priority)
+{
+    const auto key = mxcUri.toString();
+    if (!d->transfers.contains(key))
+    {
+        const auto cachedFileName = MediaCache::instance().find(mxcUri);
+        if (!cachedFileName.isEmpty())
+        {
+            auto* request = new DownloadRequest(mxcUri,
+                localFilename.isEmpty() ? cachedFileName : localFilename,
+                this);
+            // Let the caller connect to the request first
+            QTimer::singleShot(0, request, [this,cachedFileName,request] {
+                d->deliver(cachedFileName, request);
+            });
+            return request;
+        }
+    }
+    auto& transfer = d->transfers[key];
+    const bool isNew = transfer.requests.empty();
+    if (isNew)
+    {
+        transfer.mxcUri = mxcUri;
+        transfer.fileName = MediaCache::instance().partialFilePath(mxcUri);
+        transfer.priority = priority;
+    }
+    auto* request = new DownloadRequest(mxcUri,
+        localFilename.isEmpty() ? transfer.fileName : localFilename, this);
+    transfer.requests.push_back(request);
+
+    if (isNew)
+        d->queues[priority].push_back(key);
+    else if (!transfer.job && priority > transfer.priority)
+    {
+        // Move the waiting download to the higher priority queue
+        auto& oldQueue = d->queues[transfer.priority];
+        oldQueue.erase(std::remove(oldQueue.begin(), oldQueue.end(), key),
+                       oldQueue.end());
+        d->queues[priority].push_back(key);
+        transfer.priority = priority;
+    }
+    d->dispatch();
+    return request;
+}
+
+int DownloadManager::maxConcurrentDownloads() const
+{
+    return d->maxConcurrentDownloads;
+}
+
+void DownloadManager::setMaxConcurrentDownloads(int newMax)
+{
+    d->maxConcurrentDownloads = std::max(newMax, 1);
+    d->dispatch();
+}
+
+int DownloadManager::runningCount() const
+{
+    return d->running;
+}
+
+int DownloadManager::queuedCount() const
+{
+    return int(d->transfers.size()) - d->running;
+}
@@ -0,0 +1,118 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtCore/QUrl>
+
+#include <memory>
+
+namespace QMatrixClient
+{
+    class Connection;
+    class DownloadManager;
+
+    /** A handle to a single request to DownloadManager
+     *
+     * The object is owned by the download manager and is deleted after
+     * any of completed(), failed() or cancel().
+     */
+    class DownloadRequest : public QObject
+    {
+            Q_OBJECT
+        public:
+            QUrl mxcUri() const { return _mxcUri; }
+            /** The file the content is (or will be) saved to
+             * Unless the request asked for a particular file name, this is
+             * the file in MediaCache, which can be evicted from it later on.
+             * The name can change before completed() if the content turns
+             * out to be too large for the cache.
+             */
+            QString localFileName() const { return _localFileName; }
+
+        public slots:
+            /** Cancel the request
+             * The download itself is only stopped when there are no other
+             * requests for the same content.
+             */
+            void cancel();
+
+        signals:
+            void progress(qint64 received, qint64 total);
+            void completed(QString localFileName);
+            void failed(QString errorMessage);
+
+        private:
+            friend class DownloadManager;
+            DownloadRequest(QUrl mxcUri, QString localFileName,
+                            DownloadManager* manager);
+
+            DownloadManager* _manager;
+            QUrl _mxcUri;
+            QString _localFileName;
+    };
+
+    /** Connection-wide queue of media downloads
+     *
+     * DownloadManager limits the number of downloads running at the same
+     * time, starts downloads requested by the user before prefetching and
+     * downloads each piece of content only once, no matter how many rooms
+     * ask for it. The content is downloaded into MediaCache, and later
+     * requests for it are served from there; requests that ask to save
+     * the content under a particular file name get a hard link to (or,
+     * where that's impossible, a copy of) the cached file.
+     *
+     * Use Connection::downloadManager() to get the instance for a connection.
+     */
+    class DownloadManager : public QObject
+    {
+            Q_OBJECT
+            Q_PROPERTY(int maxConcurrentDownloads READ maxConcurrentDownloads WRITE setMaxConcurrentDownloads)
+        public:
+            enum Priority { Prefetch = 0, UserInitiated };
+            Q_ENUM(Priority)
+
+            explicit DownloadManager(Connection* connection);
+            ~DownloadManager() override;
+
+            /** Request a download of the content at \p mxcUri
+             * \param localFilename where to save the content; if empty,
+             *        the file in the media cache is used (or a file in
+             *        the temporary directory, for content too large for
+             *        the cache)
+             * \param priority user-initiated downloads are started before
+             *        any prefetching ones; requesting the same content with
+             *        a higher priority raises the priority of the download
+             */
+            DownloadRequest* download(const QUrl& mxcUri,
+                                      const QString& localFilename = {},
+                                      Priority priority = UserInitiated);
+
+            int maxConcurrentDownloads() const;
+            void setMaxConcurrentDownloads(int newMax);
+
+            int runningCount() const;
+            int queuedCount() const;
+
+        private:
+            friend class DownloadRequest;
+            class Private;
+            std::unique_ptr<Private> d;
+    };
+}  // namespace QMatrixClient
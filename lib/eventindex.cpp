@@ -0,0 +1,125 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "eventindex.h"
+
+#include <QtCore/QHash>
+
+#include <algorithm>
+
+using namespace QMatrixClient;
+
+static constexpr size_t MinCapacity = 16;
+
+quint32 EventIndex::fingerprint(const QString& evtId)
+{
+    const quint32 h = qHash(evtId);
+    // The two lowest values mark empty and removed slots
+    return h > Removed ? h : h + 2;
+}
+
+void EventIndex::insert(const QString& evtId, index_t index)
+{
+    // Keep at least a quarter of slots empty so that probing stays short
+    if (size_t(_count + _removed + 1) * 4 > _slots.size() * 3)
+    {
+        // Mostly removed slots are reclaimed without growing the table
+        const bool grow = _count >= _removed;
+        rehash(std::max(MinCapacity, _slots.size() * (grow ? 2 : 1)));
+    }
+    const auto h = fingerprint(evtId);
+    auto i = h & mask();
+    while (_slots[i].hash > Removed)
+        i = (i + 1) & mask();
+    if (_slots[i].hash == Removed)
+        --_removed;
+    _slots[i] = { h, index };
+    ++_count;
+}
+
+bool EventIndex::remove(const QString& evtId, index_t index)
+{
+    if (_count == 0)
+        return false;
+    const auto h = fingerprint(evtId);
+    for (auto i = h & mask(); _slots[i].hash != Empty; i = (i + 1) & mask())
+    {
+        auto& s = _slots[i];
+        if (s.hash == h && s.index == index)
+        {
+            // An empty slot after this one ends no probe sequence that
+            // passes here, so the slot can be emptied instead of marked
+            s.hash = _slots[(i + 1) & mask()].hash == Empty ? Empty : Removed;
+            if (s.hash == Removed)
+                ++_removed;
+            --_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t fittingCapacity(size_t size, size_t capacity)
+{
+    while (size * 4 > capacity * 3)
+        capacity *= 2;
+    return capacity;
+}
+
+void EventIndex::reserve(int size)
+{
+    const auto capacity = fittingCapacity(size_t(size),
+                                          std::max(MinCapacity, _slots.size()));
+    if (capacity > _slots.size())
+        rehash(capacity);
+}
+
+void EventIndex::squeeze()
+{
+    if (_count == 0)
+    {
+        clear();
+        return;
+    }
+    const auto capacity = fittingCapacity(size_t(_count) + 1, MinCapacity);
+    if (capacity < _slots.size() || _removed > 0)
+        rehash(capacity);
+}
+
+void EventIndex::clear()
+{
+    std::vector<Slot>().swap(_slots);
+    _count = 0;
+    _removed = 0;
+}
+
+void EventIndex::rehash(size_t capacity)
+{
+    std::vector<Slot> oldSlots(capacity);
+    oldSlots.swap(_slots);
+    const auto newMask = mask();
+    for (const auto& s: oldSlots)
+        if (s.hash > Removed)
+        {
+            auto i = s.hash & newMask;
+            while (_slots[i].hash != Empty)
+                i = (i + 1) & newMask;
+            _slots[i] = s;
+        }
+    _removed = 0;
+}
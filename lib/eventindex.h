@@ -0,0 +1,99 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QString>
+
+#include <vector>
+
+namespace QMatrixClient
+{
+    /** A flat index from event ids to timeline positions
+     *
+     * Instead of event ids, the index keeps a 32-bit fingerprint of each id
+     * next to the timeline position, in an open-addressing table with
+     * linear probing - 8 bytes per slot, with at most 3/4 of slots used.
+     * A fingerprint match is verified by comparing the id of the event at
+     * the found position with the requested one, so the index never needs
+     * its own copy of an event id. Lookups take an \p idAt callable that
+     * returns the id of the event at a given timeline position.
+     */
+    class EventIndex
+    {
+        public:
+            using index_t = int;
+
+            /** Find the timeline position of the event with \p evtId
+             * \return a pointer to the position, or nullptr if the event is
+             *         not indexed; the pointer is invalidated by insert()
+             */
+            template <typename IdAtT>
+            const index_t* find(const QString& evtId, IdAtT idAt) const
+            {
+                if (_count == 0)
+                    return nullptr;
+                const auto h = fingerprint(evtId);
+                for (auto i = h & mask();; i = (i + 1) & mask())
+                {
+                    const auto& s = _slots[i];
+                    if (s.hash == Empty)
+                        return nullptr;
+                    if (s.hash == h && idAt(s.index) == evtId)
+                        return &s.index;
+                }
+            }
+            template <typename IdAtT>
+            bool contains(const QString& evtId, IdAtT idAt) const
+            {
+                return find(evtId, idAt) != nullptr;
+            }
+
+            /// Add an event that is not in the index yet
+            void insert(const QString& evtId, index_t index);
+            /// Remove the event at \p index; \p evtId must be its id
+            bool remove(const QString& evtId, index_t index);
+            void reserve(int size);
+            /// Shrink the table to fit the current number of events
+            void squeeze();
+            void clear();
+
+            int size() const { return _count; }
+            /// The number of bytes taken by the table
+            qint64 memoryUsage() const
+            {
+                return qint64(_slots.capacity() * sizeof(Slot));
+            }
+
+        private:
+            enum : quint32 { Empty = 0, Removed = 1 };
+            struct Slot
+            {
+                quint32 hash = Empty;
+                index_t index = 0;
+            };
+
+            std::vector<Slot> _slots;
+            int _count = 0;
+            int _removed = 0;
+
+            static quint32 fingerprint(const QString& evtId);
+            quint32 mask() const { return quint32(_slots.size() - 1); }
+            void rehash(size_t capacity);
+    };
+}  // namespace QMatrixClient
@@ -52,26 +52,46 @@ namespace QMatrixClient
     {
         public:
             explicit EventItemBase(RoomEventPtr&& e)
-                : evt(std::move(e))
+                : evt(share(std::move(e)))
             {
                 Q_ASSERT(evt);
             }
 
-            const RoomEvent* event() const { return rawPtr(evt); }
+            const RoomEvent* event() const { return evt.get(); }
             const RoomEvent* get() const { return event(); }
             template <typename EventT>
             const EventT* viewAs() const { return eventCast<const EventT>(evt); }
-            const RoomEventPtr& operator->() const { return evt; }
+            const RoomEvent* operator->() const { return event(); }
             const RoomEvent& operator*() const { return *evt; }
 
-            // Used for event redaction
-            RoomEventPtr replaceEvent(RoomEventPtr&& other)
+            /// The number of handles to the event, including the item
+            long useCount() const { return evt.use_count(); }
+
+            /** Put another event in the item, e.g. upon redaction
+             * \return the handle to the replaced event; the event is only
+             *         deleted when the last handle to it is gone
+             */
+            RoomEventHandle replaceEvent(RoomEventPtr&& other)
             {
-                return std::exchange(evt, move(other));
+                return std::exchange(evt, share(std::move(other)));
             }
 
+        protected:
+            /// Only pending events are edited, before they are synced
+            RoomEvent& editEvent() { return *evt; }
+
+            std::shared_ptr<RoomEvent> evt;
+
         private:
-            RoomEventPtr evt;
+            /// Take over the event, placing the control block of the shared
+            /// pointer in the current EventArena if there's one
+            static std::shared_ptr<RoomEvent> share(RoomEventPtr&& e)
+            {
+                if (!e)
+                    return {};
+                return { e.release(), std::default_delete<RoomEvent>(),
+                         EventArenaAllocator<RoomEvent>() };
+            }
     };
 
     class TimelineItem : public EventItemBase
@@ -87,6 +107,15 @@ namespace QMatrixClient
 
             index_t index() const { return idx; }
 
+            /** A shared reference to the event
+             * The event stays alive as long as there's a handle to it, even
+             * after redaction replaces it in the item. Events of the timeline
+             * don't change once shared, so handles can be passed to other
+             * threads and read there without copying. Pending events are
+             * still edited and have no handles.
+             */
+            RoomEventHandle handle() const { return evt; }
+
         private:
             index_t idx;
     };
@@ -94,15 +123,15 @@ namespace QMatrixClient
     template<>
     inline const StateEventBase* EventItemBase::viewAs<StateEventBase>() const
     {
-        return evt->isStateEvent() ? weakPtrCast<const StateEventBase>(evt)
-                                   : nullptr;
+        return evt->isStateEvent()
+                ? static_cast<const StateEventBase*>(evt.get()) : nullptr;
     }
 
     template<>
     inline const CallEventBase* EventItemBase::viewAs<CallEventBase>() const
     {
-        return evt->isCallEvent() ? weakPtrCast<const CallEventBase>(evt)
-                                  : nullptr;
+        return evt->isCallEvent()
+                ? static_cast<const CallEventBase*>(evt.get()) : nullptr;
     }
 
     class PendingEventItem : public EventItemBase
@@ -119,7 +148,7 @@ namespace QMatrixClient
             void setReachedServer(const QString& eventId)
             {
                 setStatus(EventStatus::ReachedServer);
-                (*this)->addId(eventId);
+                editEvent().addId(eventId);
             }
             void setSendingFailed(QString errorText)
             {
@@ -21,6 +21,7 @@
 #include "logging.h"
 
 #include <QtCore/QJsonDocument>
+#include <QtCore/QMutex>
 
 using namespace QMatrixClient;
 
@@ -60,22 +61,89 @@ Event::~Event() = default;
 
 QString Event::matrixType() const
 {
-    return fullJson()[TypeKeyL].toString();
+    return isCompact() ? _matrixType : fullJson()[TypeKeyL].toString();
 }
 
 QByteArray Event::originalJson() const
 {
-    return QJsonDocument(_json).toJson();
+    return QJsonDocument(originalJsonObject()).toJson();
 }
 
+namespace
+{
+    /// Guards lazy decoding of compact events read from several threads
+    QMutex& decodingMutex(const Event* e)
+    {
+        static QMutex mutexes[16];
+        return mutexes[(quintptr(e) / sizeof(void*)) % 16];
+    }
+}
+
+QJsonObject Event::originalJsonObject() const
+{
+    if (!isCompact())
+        return _json;
+    QMutexLocker lock { &decodingMutex(this) };
+    return _json.isEmpty() ? QJsonDocument::fromJson(_compactJson).object()
+                           : _json;
+}
+
+const QJsonObject& Event::fullJson() const
+{
+    if (isCompact())
+    {
+        QMutexLocker lock { &decodingMutex(this) };
+        if (_json.isEmpty())
+            _json = QJsonDocument::fromJson(_compactJson).object();
+    }
+    return _json;
+}
+
+QByteArray Event::compactJson() const
+{
+    return isCompact() ? _compactJson
+                       : QJsonDocument(_json).toJson(QJsonDocument::Compact);
+}
+
+int Event::jsonSize() const
+{
+    if (isCompact())
+        return _compactJson.size();
+    if (_jsonSize < 0)
+        _jsonSize = compactJson().size();
+    return _jsonSize;
+}
+
+void Event::compact() const
+{
+    if (!isCompact())
+    {
+        _matrixType = matrixType();
+        _compactJson = QJsonDocument(_json).toJson(QJsonDocument::Compact);
+        _jsonSize = _compactJson.size();
+    }
+    _json = QJsonObject();
+}
+
+QJsonObject& Event::editJson()
+{
+    fullJson();
+    _compactJson.clear();
+    _matrixType.clear();
+    _jsonSize = -1;
+    return _json;
+}
+
+// Parts of compact events are decoded into a temporary, leaving the event
+// compact; only fullJson() keeps the decoded JSON in the event
 const QJsonObject Event::contentJson() const
 {
-    return fullJson()[ContentKeyL].toObject();
+    return originalJsonObject()[ContentKeyL].toObject();
 }
 
 const QJsonObject Event::unsignedJson() const
 {
-    return fullJson()[UnsignedKeyL].toObject();
+    return originalJsonObject()[UnsignedKeyL].toObject();
 }
 
 void Event::dumpTo(QDebug dbg) const
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include "eventarena.h"
 #include "converters.h"
 #include "logging.h"
 
@@ -50,6 +51,10 @@ namespace QMatrixClient
         return unique_ptr_cast<TargetT>(ptr);
     }
 
+    /// A shared read-only reference to an event \sa EventItemBase::handle
+    template <typename EventT>
+    using event_handle_tt = std::shared_ptr<const EventT>;
+
     // === Standard Matrix key names and basicEventJson() ===
 
     static const auto TypeKey = QStringLiteral("type");
@@ -231,12 +236,45 @@ namespace QMatrixClient
             Event& operator=(Event&&) = delete;
             virtual ~Event();
 
+            // Events are allocated in the current EventArena if there's one
+            static void* operator new(size_t size)
+            { return EventArena::allocate(size); }
+            static void operator delete(void* ptr) noexcept
+            { EventArena::deallocate(ptr); }
+
             Type type() const { return _type; }
             QString matrixType() const;
             QByteArray originalJson() const;
-            QJsonObject originalJsonObject() const { return fullJson(); }
-
-            const QJsonObject& fullJson() const { return _json; }
+            /// Unlike fullJson(), doesn't keep the JSON of compact events
+            /// decoded \sa compact
+            QJsonObject originalJsonObject() const;
+
+            /** The full event JSON
+             * For compact events the JSON is decoded on the first call and
+             * is kept in the event until compact() is called again. Callers
+             * that don't need a reference should use originalJsonObject()
+             * or the accessors of the event parts instead.
+             */
+            const QJsonObject& fullJson() const;
+            /// The event JSON as compact UTF-8 text
+            QByteArray compactJson() const;
+            /** The size of compactJson(), in bytes
+             * The size is measured once and stored in the event; compact
+             * events know it without measuring.
+             */
+            int jsonSize() const;
+
+            /** Store the event JSON as compact UTF-8 text
+             *
+             * The decoded JSON takes several times more memory than its
+             * text; compact events only keep the text and the fields most
+             * used by the library, decoding the rest on demand. Calling
+             * this on a compact event drops the JSON decoded since then,
+             * so it must not be called on events shared with other threads.
+             * Editing the JSON makes the event non-compact again.
+             */
+            virtual void compact() const;
+            bool isCompact() const { return !_compactJson.isEmpty(); }
 
             // According to the CS API spec, every event also has
             // a "content" object; but since its structure is different for
@@ -271,11 +309,17 @@ namespace QMatrixClient
             virtual void dumpTo(QDebug dbg) const;
 
         protected:
-            QJsonObject& editJson() { return _json; }
+            QJsonObject& editJson();
 
         private:
             Type _type;
-            QJsonObject _json;
+            /// Empty while a compact event is not decoded
+            mutable QJsonObject _json;
+            mutable QByteArray _compactJson;
+            /// Only used while the event is compact
+            mutable QString _matrixType;
+            /// -1 until measured
+            mutable int _jsonSize = -1;
     };
     using EventPtr = event_ptr_tt<Event>;
 
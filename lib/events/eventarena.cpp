@@ -0,0 +1,169 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "eventarena.h"
+
+#include <atomic>
+#include <new>
+
+using namespace QMatrixClient;
+
+namespace
+{
+    constexpr size_t Alignment = alignof(std::max_align_t);
+    constexpr size_t alignUp(size_t n)
+    {
+        return (n + Alignment - 1) / Alignment * Alignment;
+    }
+
+    struct Block
+    {
+        explicit Block(size_t size) : size(size) { }
+
+        /// The arena holds a reference until it moves on to another block
+        std::atomic<size_t> refCount { 1 };
+        size_t used = 0;
+        size_t size;
+    };
+    constexpr size_t BlockHeaderSize = alignUp(sizeof(Block));
+    /// Each allocation is preceded by this header
+    struct AllocHeader
+    {
+        /// nullptr if the allocation has been made outside of arenas
+        Block* block;
+        size_t size;
+    };
+    constexpr size_t AllocHeaderSize = alignUp(sizeof(AllocHeader));
+
+    // Process-wide occupancy of the blocks
+    std::atomic<qint64> totalBlockBytes { 0 };
+    std::atomic<qint64> liveBytes { 0 };
+
+    void release(Block* block) noexcept
+    {
+        if (block->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            totalBlockBytes -= qint64(block->size);
+            block->~Block();
+            ::operator delete(block);
+        }
+    }
+
+    std::atomic<bool> arenasEnabled { false };
+    thread_local EventArena* currentArena = nullptr;
+}
+
+constexpr size_t EventArena::DefaultBlockSize;
+
+class EventArena::Private
+{
+    public:
+        size_t blockSize;
+        EventArena* outerArena;
+        /// The current block for other events and for state events
+        Block* blocks[2] = { nullptr, nullptr };
+
+        char* allocate(size_t size, bool stateEvent);
+};
+
+char* EventArena::Private::allocate(size_t size, bool stateEvent)
+{
+    auto*& block = blocks[stateEvent];
+    if (!block || block->used + size > blockSize)
+    {
+        if (block)
+            release(block);
+        block = new (::operator new(BlockHeaderSize + blockSize))
+                    Block(blockSize);
+        totalBlockBytes += qint64(blockSize);
+    }
+    auto* p = reinterpret_cast<char*>(block) + BlockHeaderSize + block->used;
+    block->used += size;
+    block->refCount.fetch_add(1, std::memory_order_relaxed);
+    new (p) AllocHeader { block, size };
+    liveBytes += qint64(size);
+    return p;
+}
+
+EventArena::EventArena(size_t blockSize)
+{
+    if (!arenasEnabled)
+        return;
+    d = std::make_unique<Private>();
+    d->blockSize = blockSize;
+    d->outerArena = currentArena;
+    currentArena = this;
+}
+
+EventArena::~EventArena()
+{
+    if (!d)
+        return;
+    currentArena = d->outerArena;
+    for (auto* block: d->blocks)
+        if (block)
+            release(block);
+}
+
+bool EventArena::isEnabled()
+{
+    return arenasEnabled;
+}
+
+void EventArena::setEnabled(bool enable)
+{
+    arenasEnabled = enable;
+}
+
+void* EventArena::allocate(size_t size, bool stateEvent)
+{
+    const auto fullSize = AllocHeaderSize + alignUp(size);
+    // Large objects would waste too much of the block
+    if (currentArena && fullSize <= currentArena->d->blockSize / 4)
+        return currentArena->d->allocate(fullSize, stateEvent)
+                + AllocHeaderSize;
+
+    auto* p = static_cast<char*>(::operator new(AllocHeaderSize + size));
+    new (p) AllocHeader { nullptr, 0 };
+    return p + AllocHeaderSize;
+}
+
+void EventArena::deallocate(void* ptr) noexcept
+{
+    if (!ptr)
+        return;
+    auto* p = static_cast<char*>(ptr) - AllocHeaderSize;
+    const auto* header = reinterpret_cast<AllocHeader*>(p);
+    if (auto* block = header->block)
+    {
+        liveBytes -= qint64(header->size);
+        release(block);
+    }
+    else
+        ::operator delete(p);
+}
+
+qint64 EventArena::blockBytes()
+{
+    return totalBlockBytes;
+}
+
+qint64 EventArena::unusedBytes()
+{
+    return totalBlockBytes - liveBytes;
+}
@@ -0,0 +1,100 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QtGlobal>
+
+#include <cstddef>
+#include <memory>
+
+namespace QMatrixClient
+{
+    /** A scope in which events are allocated from shared memory blocks
+     *
+     * While an EventArena object exists, events created in the same thread
+     * are placed one after another in large blocks instead of taking
+     * a separate heap allocation each. A block is released once all events
+     * placed in it are deleted; so events loaded together, such as
+     * a timeline chunk or a state snapshot, cost a few allocations instead
+     * of one per event. Events can still be deleted one by one, in any
+     * thread. Arenas can be nested, the innermost one being used.
+     *
+     * State events usually outlive the events around them, ending up in
+     * the room state when the timeline is trimmed; so each arena places
+     * them in blocks of their own, lest a single state event keep a whole
+     * block of deleted message events in memory.
+     *
+     * Only event objects themselves are placed in arenas; the JSON and
+     * strings inside them use the usual Qt allocation. Arenas are disabled
+     * by default; EventArena objects do nothing unless they are enabled.
+     */
+    class EventArena
+    {
+        public:
+            static constexpr size_t DefaultBlockSize = 16 * 1024;
+
+            explicit EventArena(size_t blockSize = DefaultBlockSize);
+            ~EventArena();
+            EventArena(const EventArena&) = delete;
+            EventArena& operator=(const EventArena&) = delete;
+
+            static bool isEnabled();
+            static void setEnabled(bool enable);
+
+            /// Allocate memory in the current arena of the thread, if any
+            static void* allocate(size_t size, bool stateEvent = false);
+            /// Release memory obtained from allocate()
+            static void deallocate(void* ptr) noexcept;
+
+            /// The total size of arena blocks in the process
+            static qint64 blockBytes();
+            /** The size of arena blocks not taken by live events
+             * This includes the space freed by deleted events, which is
+             * only reclaimed when the whole block is released.
+             */
+            static qint64 unusedBytes();
+
+        private:
+            class Private;
+            std::unique_ptr<Private> d;
+    };
+
+    /** An allocator placing objects in the current EventArena
+     * This is meant for objects living along with events, such as
+     * the control blocks of shared pointers to them.
+     */
+    template <typename T>
+    struct EventArenaAllocator
+    {
+        using value_type = T;
+
+        EventArenaAllocator() = default;
+        template <typename U>
+        EventArenaAllocator(const EventArenaAllocator<U>&) { }
+
+        T* allocate(size_t n)
+        { return static_cast<T*>(EventArena::allocate(n * sizeof(T))); }
+        void deallocate(T* p, size_t) noexcept { EventArena::deallocate(p); }
+
+        template <typename U>
+        bool operator==(const EventArenaAllocator<U>&) const { return true; }
+        template <typename U>
+        bool operator!=(const EventArenaAllocator<U>&) const { return false; }
+    };
+}  // namespace QMatrixClient
@@ -32,7 +32,7 @@ namespace QMatrixClient
             { }
 
             QString redactedEvent() const
-            { return fullJson()["redacts"_ls].toString(); }
+            { return originalJsonObject()["redacts"_ls].toString(); }
             QString reason() const
             { return contentJson()["reason"_ls].toString(); }
     };
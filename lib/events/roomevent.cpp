@@ -19,6 +19,7 @@
 #include "roomevent.h"
 
 #include "redactionevent.h"
+#include "stringpool.h"
 #include "converters.h"
 #include "logging.h"
 
@@ -34,6 +35,8 @@ RoomEvent::RoomEvent(Type type, event_mtype_t matrixType,
 
 RoomEvent::RoomEvent(Type type, const QJsonObject& json)
     : Event(type, json)
+    , _senderId(json["sender"_ls].toString())
+    , _stateKey(json["state_key"_ls].toString())
 {
     const auto unsignedData = json[UnsignedKeyL].toObject();
     const auto redaction = unsignedData[RedactedCauseKeyL];
@@ -52,22 +55,23 @@ RoomEvent::~RoomEvent() = default; // Let the smart pointer do its job
 
 QString RoomEvent::id() const
 {
-    return fullJson()[EventIdKeyL].toString();
+    return isCompact() ? _id : fullJson()[EventIdKeyL].toString();
 }
 
 QDateTime RoomEvent::timestamp() const
 {
-    return QMatrixClient::fromJson<QDateTime>(fullJson()["origin_server_ts"_ls]);
+    return isCompact() ? _timestamp
+        : QMatrixClient::fromJson<QDateTime>(fullJson()["origin_server_ts"_ls]);
 }
 
 QString RoomEvent::roomId() const
 {
-    return fullJson()["room_id"_ls].toString();
+    return originalJsonObject()["room_id"_ls].toString();
 }
 
 QString RoomEvent::senderId() const
 {
-    return fullJson()["sender"_ls].toString();
+    return _senderId;
 }
 
 QString RoomEvent::redactionReason() const
@@ -82,7 +86,7 @@ QString RoomEvent::transactionId() const
 
 QString RoomEvent::stateKey() const
 {
-    return fullJson()["state_key"_ls].toString();
+    return _stateKey;
 }
 
 void RoomEvent::setTransactionId(const QString& txnId)
@@ -102,6 +106,23 @@ void RoomEvent::addId(const QString& newId)
     Q_ASSERT(id() == newId);
 }
 
+void RoomEvent::compact() const
+{
+    if (!isCompact())
+    {
+        _id = id();
+        _timestamp = timestamp();
+    }
+    Event::compact();
+}
+
+void RoomEvent::internIds(StringPool& pool) const
+{
+    _senderId = pool.intern(_senderId);
+    if (!_stateKey.isEmpty())
+        _stateKey = pool.intern(_stateKey);
+}
+
 QJsonObject makeCallContentJson(const QString& callId, int version,
                                 QJsonObject content)
 {
@@ -25,6 +25,7 @@
 namespace QMatrixClient
 {
     class RedactionEvent;
+    class StringPool;
 
     /** This class corresponds to m.room.* events */
     class RoomEvent : public Event
@@ -81,10 +82,23 @@ namespace QMatrixClient
              */
             void addId(const QString& newId);
 
+            /// Also keeps the id and the timestamp
+            void compact() const override;
+            /// Share the storage of the sender and the state key
+            /// with equal strings in the pool
+            void internIds(StringPool& pool) const;
+
         private:
             event_ptr_tt<RedactionEvent> _redactedBecause;
+            // Kept apart from the JSON so that they could be interned
+            mutable QString _senderId;
+            mutable QString _stateKey;
+            // Only used while the event is compact
+            mutable QString _id;
+            mutable QDateTime _timestamp;
     };
     using RoomEventPtr = event_ptr_tt<RoomEvent>;
+    using RoomEventHandle = event_handle_tt<RoomEvent>;
     using RoomEvents = EventsArray<RoomEvent>;
     using RoomEventsRange = Range<RoomEvents>;
 
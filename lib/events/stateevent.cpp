@@ -25,8 +25,9 @@ using namespace QMatrixClient;
 
 bool StateEventBase::repeatsState() const
 {
-    const auto prevContentJson = unsignedJson().value(PrevContentKeyL);
-    return fullJson().value(ContentKeyL) == prevContentJson;
+    const auto json = originalJsonObject();
+    return json.value(ContentKeyL)
+            == json.value(UnsignedKeyL).toObject().value(PrevContentKeyL);
 }
 
 QString StateEventBase::replacedState() const
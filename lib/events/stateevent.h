@@ -29,6 +29,12 @@ namespace QMatrixClient {
             using RoomEvent::RoomEvent;
             ~StateEventBase() override = default;
 
+            // State events get arena blocks of their own \sa EventArena
+            static void* operator new(size_t size)
+            { return EventArena::allocate(size, true); }
+            static void operator delete(void* ptr) noexcept
+            { EventArena::deallocate(ptr); }
+
             bool isStateEvent() const override { return true; }
             QString replacedState() const;
             void dumpTo(QDebug dbg) const override;
@@ -36,6 +42,7 @@ namespace QMatrixClient {
             virtual bool repeatsState() const;
     };
     using StateEventPtr = event_ptr_tt<StateEventBase>;
+    using StateEventHandle = event_handle_tt<StateEventBase>;
     using StateEvents = EventsArray<StateEventBase>;
 
     /**
@@ -0,0 +1,135 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "imagedecoder.h"
+
+#include "logging.h"
+
+#include <QtGui/QImageReader>
+#include <QtCore/QBuffer>
+#include <QtCore/QFile>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+
+using namespace QMatrixClient;
+
+QImage QMatrixClient::decodeImage(QIODevice* source, QSize maxSize)
+{
+    QImageReader reader { source };
+    if (maxSize.isValid())
+    {
+        const auto fullSize = reader.size();
+        if (fullSize.isValid() && (fullSize.width() > maxSize.width()
+                                   || fullSize.height() > maxSize.height()))
+            reader.setScaledSize(fullSize.scaled(maxSize, Qt::KeepAspectRatio));
+    }
+    auto image = reader.read();
+    if (image.isNull())
+    {
+        qCWarning(MAIN) << "Couldn't decode an image:" << reader.errorString();
+        return image;
+    }
+    // Some formats don't report their size in advance
+    if (maxSize.isValid() && (image.width() > maxSize.width()
+                              || image.height() > maxSize.height()))
+        image = image.scaled(maxSize, Qt::KeepAspectRatio,
+                             Qt::SmoothTransformation);
+    return image;
+}
+
+namespace
+{
+    class ImageTask : public QRunnable
+    {
+        public:
+            using work_t = std::function<QImage()>;
+
+            ImageTask(work_t work, const QObject* context,
+                      const image_callback_t& callback)
+                : work(std::move(work))
+                , notifier(new _impl::ImageNotifier)
+            {
+                // The notifier lives in the requesting thread, so the
+                // connection below is queued when ready() is emitted from
+                // the worker; destroying the context breaks the connection.
+                QObject::connect(notifier, &_impl::ImageNotifier::ready,
+                                 context, callback);
+            }
+            ~ImageTask() override
+            {
+                // The task may be dropped from the pool without running
+                if (notifier)
+                    notifier->deleteLater();
+            }
+
+            void run() override
+            {
+                emit notifier->ready(work());
+                notifier->deleteLater();
+                notifier = nullptr;
+            }
+
+        private:
+            work_t work;
+            _impl::ImageNotifier* notifier;
+    };
+
+    void startTask(ImageTask::work_t work, const QObject* context,
+                   const image_callback_t& callback)
+    {
+        QThreadPool::globalInstance()->start(
+            new ImageTask(std::move(work), context, callback));
+    }
+}
+
+void QMatrixClient::decodeImageAsync(QByteArray data, QSize maxSize,
+                                     const QObject* context,
+                                     image_callback_t callback)
+{
+    startTask([data,maxSize] {
+        QBuffer buffer;
+        buffer.setData(data);
+        buffer.open(QIODevice::ReadOnly);
+        return decodeImage(&buffer, maxSize);
+    }, context, callback);
+}
+
+void QMatrixClient::decodeImageFileAsync(QString fileName, QSize maxSize,
+                                         const QObject* context,
+                                         image_callback_t callback)
+{
+    startTask([fileName,maxSize] {
+        QFile file { fileName };
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            qCWarning(MAIN) << "Couldn't open" << fileName << "for reading";
+            return QImage();
+        }
+        return decodeImage(&file, maxSize);
+    }, context, callback);
+}
+
+void QMatrixClient::scaleImageAsync(QImage image, QSize size,
+                                    const QObject* context,
+                                    image_callback_t callback)
+{
+    startTask([image,size] {
+        return image.scaled(size, Qt::KeepAspectRatio,
+                            Qt::SmoothTransformation);
+    }, context, callback);
+}
@@ -0,0 +1,68 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtGui/QImage>
+
+#include <functional>
+
+class QIODevice;
+
+namespace QMatrixClient
+{
+    using image_callback_t = std::function<void(QImage)>;
+
+    /** Decode an image, fitting it into \p maxSize
+     *
+     * Where the image format allows, the image is scaled while decoding
+     * so that the full-resolution image is never held in memory.
+     * Images smaller than \p maxSize are not scaled up; an invalid
+     * \p maxSize means no scaling at all.
+     */
+    QImage decodeImage(QIODevice* source, QSize maxSize = {});
+
+    /** Decode an image from \p data in a worker thread
+     *
+     * \p callback is invoked in the thread of \p context with the result,
+     * a null image if decoding failed. If \p context is destroyed before
+     * decoding finishes, the callback is not invoked.
+     * \sa decodeImage
+     */
+    void decodeImageAsync(QByteArray data, QSize maxSize,
+                          const QObject* context, image_callback_t callback);
+    /// Decode an image from a file in a worker thread
+    void decodeImageFileAsync(QString fileName, QSize maxSize,
+                              const QObject* context,
+                              image_callback_t callback);
+    /// Scale an image to fit \p size in a worker thread
+    void scaleImageAsync(QImage image, QSize size, const QObject* context,
+                         image_callback_t callback);
+
+    namespace _impl
+    {
+        /// Carries the result of a worker back to the requesting thread
+        class ImageNotifier : public QObject
+        {
+                Q_OBJECT
+            signals:
+                void ready(QImage image);
+        };
+    }  // namespace _impl
+}  // namespace QMatrixClient
@@ -25,6 +25,8 @@
 #include <QtNetwork/QNetworkRequest>
 #include <QtNetwork/QNetworkReply>
 #include <QtCore/QTimer>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileDevice>
 #include <QtCore/QRegularExpression>
 #include <QtCore/QJsonObject>
 
@@ -84,6 +86,20 @@ class BaseJob::Private
         int maxRetries = errorStrategy.size();
         int retriesTaken = 0;
 
+        duration_t progressInterval = 100;
+        QElapsedTimer lastProgressTimer;
+
+        /// Let through the first and the final progress notification and at
+        /// most one every progressInterval in between
+        bool progressDue(qint64 bytesDone, qint64 bytesTotal)
+        {
+            if (lastProgressTimer.isValid() && bytesDone != bytesTotal
+                    && lastProgressTimer.elapsed() < progressInterval)
+                return false;
+            lastProgressTimer.start();
+            return true;
+        }
+
         LoggingCategory logCat = JOBS;
 };
 
@@ -191,6 +207,9 @@ QUrl BaseJob::makeRequestUrl(QUrl baseUrl,
     return baseUrl;
 }
 
+// Request bodies bigger than this are not buffered by QNAM
+static const qint64 UnbufferedUploadThreshold = 1024 * 1024;
+
 void BaseJob::Private::sendRequest(bool inBackground)
 {
     QNetworkRequest req
@@ -211,6 +230,26 @@ void BaseJob::Private::sendRequest(bool inBackground)
 #endif
     for (auto it = requestHeaders.cbegin(); it != requestHeaders.cend(); ++it)
         req.setRawHeader(it.key(), it.value());
+    if (auto* source = requestData.source())
+        if (!source->isSequential())
+        {
+            // A retry starts reading the device from the beginning again
+            if (source->isOpen())
+                source->reset();
+            // Stream files and big bodies straight from the device instead
+            // of letting QNAM buffer them in memory; small bodies (JSON
+            // mostly) stay buffered so that QNAM could resend them when
+            // following a redirect.
+            if (qobject_cast<QFileDevice*>(source)
+                    || source->size() > UnbufferedUploadThreshold)
+            {
+                if (!req.header(QNetworkRequest::ContentLengthHeader).isValid())
+                    req.setHeader(QNetworkRequest::ContentLengthHeader,
+                                  source->size());
+                req.setAttribute(
+                    QNetworkRequest::DoNotBufferUploadDataAttribute, true);
+            }
+        }
     switch( verb )
     {
         case HttpVerb::Get:
@@ -237,6 +276,9 @@ void BaseJob::afterStart(const ConnectionData*, QNetworkReply*)
 void BaseJob::beforeAbandon(QNetworkReply*)
 { }
 
+void BaseJob::adjustDownloadProgress(qint64&, qint64&) const
+{ }
+
 void BaseJob::start(const ConnectionData* connData, bool inBackground)
 {
     d->connection = connData;
@@ -247,8 +289,6 @@ void BaseJob::start(const ConnectionData* connData, bool inBackground)
     beforeStart(connData);
     if (status().good())
         sendRequest(inBackground);
-    if (status().good())
-        afterStart(connData, d->reply.data());
     if (!status().good())
         QTimer::singleShot(0, this, &BaseJob::finishJob);
 }
@@ -266,12 +306,20 @@ void BaseJob::sendRequest(bool inBackground)
     {
         connect( d->reply.data(), &QNetworkReply::metaDataChanged,
                  this, &BaseJob::checkReply);
-        connect( d->reply.data(), &QNetworkReply::uploadProgress,
-                 this, &BaseJob::uploadProgress);
-        connect( d->reply.data(), &QNetworkReply::downloadProgress,
-                 this, &BaseJob::downloadProgress);
+        connect( d->reply.data(), &QNetworkReply::uploadProgress, this,
+                 [this] (qint64 bytesSent, qint64 bytesTotal) {
+                     if (d->progressDue(bytesSent, bytesTotal))
+                         emit uploadProgress(bytesSent, bytesTotal);
+                 });
+        connect( d->reply.data(), &QNetworkReply::downloadProgress, this,
+                 [this] (qint64 bytesReceived, qint64 bytesTotal) {
+                     adjustDownloadProgress(bytesReceived, bytesTotal);
+                     if (d->progressDue(bytesReceived, bytesTotal))
+                         emit downloadProgress(bytesReceived, bytesTotal);
+                 });
         d->timer.start(getCurrentTimeout());
         qCDebug(d->logCat) << this << "request has been sent";
+        afterStart(d->connection, d->reply.data());
         emit started();
     }
     else
@@ -512,6 +560,16 @@ void BaseJob::setMaxRetries(int newMaxRetries)
     d->maxRetries = newMaxRetries;
 }
 
+BaseJob::duration_t BaseJob::progressInterval() const
+{
+    return d->progressInterval;
+}
+
+void BaseJob::setProgressInterval(duration_t interval)
+{
+    d->progressInterval = interval;
+}
+
 BaseJob::Status BaseJob::status() const
 {
     return d->status;
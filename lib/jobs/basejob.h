@@ -45,6 +45,7 @@ namespace QMatrixClient
             Q_OBJECT
             Q_PROPERTY(QUrl requestUrl READ requestUrl CONSTANT)
             Q_PROPERTY(int maxRetries READ maxRetries WRITE setMaxRetries)
+            Q_PROPERTY(int progressInterval READ progressInterval WRITE setProgressInterval)
         public:
             /* Just in case, the values are compatible with KJob
              * (which BaseJob used to inherit from). */
@@ -166,6 +167,15 @@ namespace QMatrixClient
             int maxRetries() const;
             void setMaxRetries(int newMaxRetries);
 
+            /** The minimal interval between progress notifications
+             * downloadProgress() and uploadProgress() are emitted at most
+             * once per this interval (100 ms by default), except that
+             * the notification about the completed transfer always
+             * comes through. Set to 0 to get every notification.
+             */
+            duration_t progressInterval() const;
+            void setProgressInterval(duration_t interval);
+
             Q_INVOKABLE duration_t getCurrentTimeout() const;
             Q_INVOKABLE duration_t getNextRetryInterval() const;
             Q_INVOKABLE duration_t millisToRetry() const;
@@ -280,9 +290,19 @@ namespace QMatrixClient
                                        const QUrlQuery& query = {});
 
             virtual void beforeStart(const ConnectionData* connData);
+            /** Called after each network request is sent, including retries
+             * Use it to connect to the signals of the new \p reply.
+             */
             virtual void afterStart(const ConnectionData* connData,
                                     QNetworkReply* reply);
             virtual void beforeAbandon(QNetworkReply*);
+            /** Translate the download progress of the current reply
+             * The default implementation passes the values through; jobs
+             * that resume an earlier download should add the bytes that
+             * are already there to \p received and \p total.
+             */
+            virtual void adjustDownloadProgress(qint64& received,
+                                                qint64& total) const;
 
             /**
              * Used by gotReply() to check the received reply for general
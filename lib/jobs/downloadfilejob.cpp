@@ -3,6 +3,9 @@
 #include <QtNetwork/QNetworkReply>
 #include <QtCore/QFile>
 #include <QtCore/QTemporaryFile>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QRegularExpression>
 
 using namespace QMatrixClient;
 
@@ -14,12 +17,87 @@ class DownloadFileJob::Private
         explicit Private(const QString& localFilename)
             : targetFile(new QFile(localFilename))
             , tempFile(new QFile(targetFile->fileName() + ".qmcdownload"))
+            , progressFile(new QFile(tempFile->fileName() + ".json"))
         { }
 
         QScopedPointer<QFile> targetFile;
         QScopedPointer<QFile> tempFile;
+        // Only downloads to a named file can resume after the job is gone
+        QScopedPointer<QFile> progressFile;
+
+        qint64 bytesReceived = 0;
+        qint64 totalSize = -1;
+        qint64 lastSavedProgress = 0;
+        // Where the current reply starts in the file
+        qint64 replyOffset = 0;
+        // Errors detected while receiving data; the HTTP status of the reply
+        // overrides the job status once the reply is finished
+        Status fileStatus { Success };
+
+        void fail(DownloadFileJob* job, QString message)
+        {
+            fileStatus = { FileError, std::move(message) };
+            job->setStatus(fileStatus);
+        }
+
+        bool restoreProgress(const QUrl& url);
+        void saveProgress(const QUrl& url);
+        void dropProgress();
 };
 
+// Save the progress on disk at least this often, so that the download
+// could resume even after a crash
+static const qint64 ProgressSaveInterval = 4 * 1024 * 1024;
+
+bool DownloadFileJob::Private::restoreProgress(const QUrl& url)
+{
+    if (!progressFile || !progressFile->open(QIODevice::ReadOnly))
+        return false;
+    const auto json =
+            QJsonDocument::fromJson(progressFile->readAll()).object();
+    progressFile->close();
+    const auto received = qint64(json.value("received").toDouble());
+    const auto size = qint64(json.value("size").toDouble(-1));
+    // The partial file must be the one preallocated for the same content
+    if (json.value("url").toString() != url.toString() || size < 0
+            || received <= 0 || received > size || tempFile->size() != size
+            || !tempFile->open(QIODevice::ReadWrite)
+            || !tempFile->seek(received))
+    {
+        tempFile->close();
+        return false;
+    }
+    bytesReceived = lastSavedProgress = received;
+    totalSize = size;
+    return true;
+}
+
+void DownloadFileJob::Private::saveProgress(const QUrl& url)
+{
+    if (!progressFile || bytesReceived == 0 || totalSize < 0)
+        return;
+    tempFile->flush();
+    if (!progressFile->open(QIODevice::WriteOnly))
+    {
+        qCWarning(JOBS) << "Couldn't save download progress to"
+                        << progressFile->fileName();
+        return;
+    }
+    progressFile->write(QJsonDocument(QJsonObject {
+        { "url", url.toString() },
+        { "received", double(bytesReceived) },
+        { "size", double(totalSize) }
+    }).toJson(QJsonDocument::Compact));
+    progressFile->close();
+    lastSavedProgress = bytesReceived;
+}
+
+void DownloadFileJob::Private::dropProgress()
+{
+    if (progressFile)
+        progressFile->remove();
+}
+
 QUrl DownloadFileJob::makeRequestUrl(QUrl baseUrl, const QUrl& mxcUri)
 {
     return makeRequestUrl(baseUrl, mxcUri.authority(), mxcUri.path().mid(1));
@@ -32,6 +110,21 @@ DownloadFileJob::DownloadFileJob(const QString& serverName,
     , d(localFilename.isEmpty() ? new Private : new Private(localFilename))
 {
     setObjectName("DownloadFileJob");
+    // Every attempt, including retries, continues from where
+    // the previous one stopped
+    connect(this, &BaseJob::aboutToStart, this, [this] {
+        auto headers = requestHeaders();
+        headers.remove("Range");
+        d->replyOffset = 0;
+        if (d->bytesReceived > 0)
+            headers.insert("Range",
+                           "bytes=" + QByteArray::number(d->bytesReceived) + '-');
+        setRequestHeaders(headers);
+    });
+    connect(this, &BaseJob::retryScheduled, this,
+            [this] { d->saveProgress(requestUrl()); });
+    connect(this, &BaseJob::failure, this,
+            [this] { d->saveProgress(requestUrl()); });
 }
 
 QString DownloadFileJob::targetFileName() const
@@ -39,6 +132,11 @@ QString DownloadFileJob::targetFileName() const
     return (d->targetFile ? d->targetFile : d->tempFile)->fileName();
 }
 
+qint64 DownloadFileJob::bytesReceived() const
+{
+    return d->bytesReceived;
+}
+
 void DownloadFileJob::beforeStart(const ConnectionData*)
 {
     if (d->targetFile && !d->targetFile->isReadable() &&
@@ -49,12 +147,18 @@ void DownloadFileJob::beforeStart(const ConnectionData*)
         setStatus(FileError, "Could not open the target file for writing");
         return;
     }
-    if (!d->tempFile->isReadable() && !d->tempFile->open(QIODevice::WriteOnly))
+    if (!d->tempFile->isReadable())
     {
-        qCWarning(JOBS) << "Couldn't open the temporary file"
-                        << d->tempFile->fileName() << "for writing";
-        setStatus(FileError, "Could not open the temporary download file");
-        return;
+        if (d->restoreProgress(requestUrl()))
+            qCDebug(JOBS) << "Resuming download to" << d->tempFile->fileName()
+                          << "from byte" << d->bytesReceived;
+        else if (!d->tempFile->open(QIODevice::WriteOnly))
+        {
+            qCWarning(JOBS) << "Couldn't open the temporary file"
+                            << d->tempFile->fileName() << "for writing";
+            setStatus(FileError, "Could not open the temporary download file");
+            return;
+        }
     }
     qCDebug(JOBS) << "Downloading to" << d->tempFile->fileName();
 }
@@ -64,18 +168,54 @@ void DownloadFileJob::afterStart(const ConnectionData*, QNetworkReply* reply)
     connect(reply, &QNetworkReply::metaDataChanged, this, [this,reply] {
         if (!status().good())
             return;
+        const auto httpCode =
+            reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (httpCode == 206)
+        {
+            // Content-Range: bytes <first>-<last>/<total>
+            static const QRegularExpression rangeRe
+                { "^bytes (\\d+)-\\d+/(\\d+|\\*)$" };
+            const auto match =
+                rangeRe.match(QString::fromLatin1(reply->rawHeader("Content-Range")));
+            const auto firstByte =
+                match.hasMatch() ? match.captured(1).toLongLong() : -1;
+            const auto totalSize = match.hasMatch() && match.captured(2) != "*"
+                                   ? match.captured(2).toLongLong() : -1;
+            if (firstByte != d->bytesReceived
+                    || (d->totalSize != -1 && totalSize != d->totalSize))
+            {
+                qCWarning(JOBS) << "Unexpected range"
+                                << reply->rawHeader("Content-Range")
+                                << "when resuming from byte"
+                                << d->bytesReceived;
+                d->bytesReceived = 0;
+                d->dropProgress();
+                d->fail(this, "Could not resume the download");
+                return;
+            }
+            d->totalSize = totalSize;
+            d->replyOffset = firstByte;
+            qCDebug(JOBS) << "Resumed download from byte" << firstByte;
+            return;
+        }
+        // The server sent the whole content; start over
+        if (d->bytesReceived > 0)
+        {
+            qCDebug(JOBS) << "The server didn't resume the download;"
+                             " restarting from the beginning";
+            d->bytesReceived = 0;
+        }
+        d->replyOffset = 0;
+        d->tempFile->seek(0);
         auto sizeHeader = reply->header(QNetworkRequest::ContentLengthHeader);
-        if (sizeHeader.isValid())
+        d->totalSize = sizeHeader.isValid() ? sizeHeader.value<qint64>() : -1;
+        // Also drops leftovers of an earlier attempt if the size is unknown
+        const auto reservedSize = std::max(d->totalSize, qint64(0));
+        if (!d->tempFile->resize(reservedSize))
         {
-            auto targetSize = sizeHeader.value<qint64>();
-            if (targetSize != -1)
-                if (!d->tempFile->resize(targetSize))
-                {
-                    qCWarning(JOBS) << "Failed to allocate" << targetSize
-                                    << "bytes for" << d->tempFile->fileName();
-                    setStatus(FileError,
-                              "Could not reserve disk space for download");
-                }
+            qCWarning(JOBS) << "Failed to allocate" << reservedSize
+                            << "bytes for" << d->tempFile->fileName();
+            d->fail(this, "Could not reserve disk space for download");
         }
     });
     connect(reply, &QIODevice::readyRead, this, [this,reply] {
@@ -83,7 +223,20 @@ void DownloadFileJob::afterStart(const ConnectionData*, QNetworkReply* reply)
             return;
         auto bytes = reply->read(reply->bytesAvailable());
         if (!bytes.isEmpty())
-            d->tempFile->write(bytes);
+        {
+            const auto written = d->tempFile->write(bytes);
+            if (written > 0)
+                d->bytesReceived += written;
+            if (written != bytes.size())
+            {
+                qCWarning(JOBS) << "Failed to write to"
+                                << d->tempFile->fileName();
+                d->fail(this, "Could not write the downloaded data");
+                return;
+            }
+            if (d->bytesReceived - d->lastSavedProgress >= ProgressSaveInterval)
+                d->saveProgress(requestUrl());
+        }
         else
             qCWarning(JOBS)
                     << "Unexpected empty chunk when downloading from"
@@ -94,12 +247,38 @@ void DownloadFileJob::afterStart(const ConnectionData*, QNetworkReply* reply)
 void DownloadFileJob::beforeAbandon(QNetworkReply*)
 {
     if (d->targetFile)
+    {
+        // Keep the partial download so that the next job could resume it
+        d->saveProgress(requestUrl());
+        d->tempFile->close();
         d->targetFile->remove();
-    d->tempFile->remove();
+    }
+    else
+        d->tempFile->remove();
+}
+
+void DownloadFileJob::adjustDownloadProgress(qint64& received,
+                                             qint64& total) const
+{
+    if (d->replyOffset == 0)
+        return;
+    received += d->replyOffset;
+    // Content-Range gives the size of the whole file, if the server knows it
+    total = d->totalSize != -1 ? d->totalSize
+                               : total != -1 ? total + d->replyOffset : -1;
 }
 
 BaseJob::Status DownloadFileJob::parseReply(QNetworkReply*)
 {
+    if (!d->fileStatus.good())
+        return d->fileStatus;
+    if (d->totalSize != -1 && d->bytesReceived != d->totalSize)
+    {
+        qCWarning(JOBS) << "Received" << d->bytesReceived << "bytes out of"
+                        << d->totalSize << "for" << d->tempFile->fileName();
+        return { FileError, "The download is incomplete" };
+    }
+    d->dropProgress();
     if (d->targetFile)
     {
         d->targetFile->close();
@@ -12,10 +12,19 @@ namespace QMatrixClient
             using GetContentJob::makeRequestUrl;
             static QUrl makeRequestUrl(QUrl baseUrl, const QUrl& mxcUri);
 
+            /** Download a file, resuming an earlier download if possible
+             * If \p localFilename is given, a partially downloaded file
+             * is kept along with its progress when the job fails or is
+             * abandoned, and the next job downloading the same content
+             * to the same file picks it up with an HTTP Range request.
+             */
             DownloadFileJob(const QString& serverName, const QString& mediaId,
                             const QString& localFilename = {});
 
             QString targetFileName() const;
+            /// The number of bytes already in the file, including those
+            /// from an earlier download that has been resumed
+            qint64 bytesReceived() const;
 
         private:
             class Private;
@@ -25,6 +34,8 @@ namespace QMatrixClient
             void afterStart(const ConnectionData*,
                             QNetworkReply* reply) override;
             void beforeAbandon(QNetworkReply*) override;
+            void adjustDownloadProgress(qint64& received,
+                                        qint64& total) const override;
             Status parseReply(QNetworkReply*) override;
     };
 }
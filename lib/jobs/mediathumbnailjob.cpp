@@ -18,6 +18,11 @@
 
 #include "mediathumbnailjob.h"
 
+#include "../imagedecoder.h"
+
+#include <QtCore/QBuffer>
+#include <QtGui/QImageReader>
+
 using namespace QMatrixClient;
 
 QUrl MediaThumbnailJob::makeRequestUrl(QUrl baseUrl,
@@ -41,13 +46,22 @@ MediaThumbnailJob::MediaThumbnailJob(const QUrl& mxcUri, QSize requestedSize)
 
 QImage MediaThumbnailJob::thumbnail() const
 {
+    if (_thumbnail.isNull() && !_thumbnailData.isEmpty())
+        _thumbnail = scaledThumbnail({});
     return _thumbnail;
 }
 
 QImage MediaThumbnailJob::scaledThumbnail(QSize toSize) const
 {
-    return _thumbnail.scaled(toSize,
-                             Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    QBuffer buffer;
+    buffer.setData(_thumbnailData);
+    buffer.open(QIODevice::ReadOnly);
+    return decodeImage(&buffer, toSize);
+}
+
+QByteArray MediaThumbnailJob::thumbnailData() const
+{
+    return _thumbnailData;
 }
 
 BaseJob::Status MediaThumbnailJob::parseReply(QNetworkReply* reply)
@@ -56,8 +70,14 @@ BaseJob::Status MediaThumbnailJob::parseReply(QNetworkReply* reply)
     if (!result.good())
         return result;
 
-    if( _thumbnail.loadFromData(data()->readAll()) )
+    // Only check the format here; the image is decoded on demand, possibly
+    // in another thread and right to the size it's needed in
+    _thumbnailData = data()->readAll();
+    QBuffer buffer { &_thumbnailData };
+    buffer.open(QIODevice::ReadOnly);
+    if (QImageReader(&buffer).canRead())
         return Success;
 
+    _thumbnailData.clear();
     return { IncorrectResponseError, "Could not read image data" };
 }
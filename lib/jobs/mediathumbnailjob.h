@@ -35,13 +35,22 @@ namespace QMatrixClient
                               QSize requestedSize);
             MediaThumbnailJob(const QUrl& mxcUri, QSize requestedSize);
 
+            /// Decode the thumbnail; this may take time for large images
             QImage thumbnail() const;
+            /** Decode the thumbnail fitting it into \p toSize
+             * Unlike scaling the result of thumbnail(), this doesn't decode
+             * the image at its full size when the format allows to do so.
+             * \sa decodeImage
+             */
             QImage scaledThumbnail(QSize toSize) const;
+            /// Raw (encoded) thumbnail image, e.g. to decode it elsewhere
+            QByteArray thumbnailData() const;
 
         protected:
             Status parseReply(QNetworkReply* reply) override;
 
         private:
-            QImage _thumbnail;
+            QByteArray _thumbnailData;
+            mutable QImage _thumbnail;
     };
 }  // namespace QMatrixClient
@@ -10,10 +10,9 @@ using namespace QMatrixClient;
 
 auto fromData(const QByteArray& data)
 {
+    // QBuffer shares the implicitly shared data instead of copying it
     auto source = std::make_unique<QBuffer>();
-    source->open(QIODevice::WriteOnly);
-    source->write(data);
-    source->close();
+    source->setData(data);
     return source;
 }
 
@@ -0,0 +1,437 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "mediacache.h"
+
+#include "util.h"
+#include "logging.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QStringBuilder>
+#include <QtCore/QTimer>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+using namespace QMatrixClient;
+
+// Partial files that haven't been written to for this long are abandoned
+static const qint64 AbandonedPartialAge = 24 * 3600 * 1000;
+
+class MediaCache::Private
+{
+    public:
+        struct Entry
+        {
+            QSize size;
+            qint64 bytes = 0;
+            qint64 lastUsed = 0; //< Milliseconds since epoch
+        };
+        using entries_t = std::vector<Entry>;
+
+        QString cachePath = cacheLocation("media");
+        QString partialPath = cacheLocation("media/partial");
+        /// Entries for each mxc URI, one per thumbnail size
+        QHash<QString, entries_t> entries;
+        int entryCount = 0;
+        qint64 totalBytes = 0;
+        /// Bytes taken by unfinished files, as of the last sweepPartials()
+        qint64 partialBytes = 0;
+        qint64 budget = 256 * 1024 * 1024;
+        int hits = 0;
+        int misses = 0;
+        int evictions = 0;
+        // Saving the index is deferred to coalesce bursts of changes;
+        // once the application is quitting, the index is saved right away
+        // as the timer won't fire anymore
+        QTimer saveTimer;
+        bool quitting = false;
+
+        static QString baseName(const QString& mxcUri, QSize size)
+        {
+            auto id = mxcUri.toUtf8();
+            if (size.isValid())
+                id += '#' + QByteArray::number(size.width()) + 'x'
+                        + QByteArray::number(size.height());
+            return QString::fromLatin1(
+                QCryptographicHash::hash(id, QCryptographicHash::Sha1).toHex());
+        }
+        QString fileName(const QString& mxcUri, QSize size) const
+        {
+            return cachePath % baseName(mxcUri, size);
+        }
+        QString partialFileName(const QString& mxcUri, QSize size) const
+        {
+            return partialPath % baseName(mxcUri, size);
+        }
+        QString indexFileName() const
+        {
+            return cachePath % "index.json";
+        }
+
+        void loadIndex();
+        void saveIndex() const;
+        /// Delete files in the cache directory that are not in the index
+        void sweepUnindexed() const;
+        /// Delete abandoned partial files and count the bytes of the rest
+        void sweepPartials();
+        void scheduleSave()
+        {
+            if (quitting)
+                saveIndex();
+            else
+                saveTimer.start();
+        }
+        void evict();
+        void dropEntry(const QString& mxcUri, QSize size);
+        /// Remove the entry from the index, leaving its file in place
+        bool forgetEntry(const QString& mxcUri, QSize size);
+};
+
+void MediaCache::Private::loadIndex()
+{
+    QFile indexFile { indexFileName() };
+    if (!indexFile.open(QIODevice::ReadOnly))
+        return;
+    const auto json = QJsonDocument::fromJson(indexFile.readAll()).object();
+    for (const auto& v: json.value("entries").toArray())
+    {
+        const auto o = v.toObject();
+        const auto uri = o.value("uri").toString();
+        Entry e;
+        if (o.contains("w"))
+            e.size = { o.value("w").toInt(), o.value("h").toInt() };
+        e.lastUsed = qint64(o.value("last_used").toDouble());
+        // Files removed behind our back are dropped from the index
+        const QFileInfo fi { fileName(uri, e.size) };
+        if (!fi.exists())
+            continue;
+        e.bytes = fi.size();
+        totalBytes += e.bytes;
+        ++entryCount;
+        entries[uri].push_back(e);
+    }
+    sweepUnindexed();
+    sweepPartials();
+    qCDebug(MAIN) << "Media cache:" << entryCount << "entries,"
+                  << totalBytes << "bytes," << partialBytes
+                  << "bytes in partial files";
+}
+
+void MediaCache::Private::sweepUnindexed() const
+{
+    QSet<QString> indexed;
+    indexed.reserve(entryCount + 1);
+    indexed.insert(QStringLiteral("index.json"));
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        for (const auto& e: *it)
+            indexed.insert(baseName(it.key(), e.size));
+    // E.g., files committed after the index has been saved for the last
+    // time before a crash; their URIs are unknown so they can't be adopted
+    int removed = 0;
+    for (const auto& name: QDir(cachePath).entryList(QDir::Files))
+        if (!indexed.contains(name) && QFile::remove(cachePath % name))
+            ++removed;
+    if (removed > 0)
+        qCDebug(MAIN) << "Media cache: removed" << removed
+                      << "files missing from the index";
+}
+
+void MediaCache::Private::sweepPartials()
+{
+    // A download leaves a placeholder, the data file and the progress file
+    // next to each other, all named after the entry; they go together
+    QHash<QString, qint64> lastModified;
+    const auto files = QDir(partialPath).entryInfoList(QDir::Files);
+    for (const auto& fi: files)
+    {
+        auto& t = lastModified[fi.fileName().section('.', 0, 0)];
+        t = std::max(t, fi.lastModified().toMSecsSinceEpoch());
+    }
+    const auto cutoff =
+        QDateTime::currentMSecsSinceEpoch() - AbandonedPartialAge;
+    partialBytes = 0;
+    for (const auto& fi: files)
+    {
+        if (lastModified.value(fi.fileName().section('.', 0, 0)) >= cutoff)
+            partialBytes += fi.size();
+        else
+            QFile::remove(fi.filePath());
+    }
+}
+
+void MediaCache::Private::saveIndex() const
+{
+    QJsonArray array;
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        for (const auto& e: *it)
+        {
+            QJsonObject o {
+                { "uri", it.key() },
+                { "last_used", double(e.lastUsed) }
+            };
+            if (e.size.isValid())
+            {
+                o.insert("w", e.size.width());
+                o.insert("h", e.size.height());
+            }
+            array.push_back(o);
+        }
+    QFile indexFile { indexFileName() };
+    if (!indexFile.open(QIODevice::WriteOnly))
+    {
+        qCWarning(MAIN) << "Couldn't save the media cache index to"
+                        << indexFile.fileName();
+        return;
+    }
+    indexFile.write(QJsonDocument(QJsonObject {{ "entries", array }})
+                    .toJson(QJsonDocument::Compact));
+}
+
+void MediaCache::Private::evict()
+{
+    sweepPartials();
+    if (totalBytes + partialBytes <= budget)
+        return;
+    std::vector<std::pair<QString, Entry>> lru;
+    lru.reserve(size_t(entryCount));
+    for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+        for (const auto& e: *it)
+            lru.emplace_back(it.key(), e);
+    std::sort(lru.begin(), lru.end(), [] (const auto& a, const auto& b) {
+        return a.second.lastUsed < b.second.lastUsed;
+    });
+    int evicted = 0;
+    for (const auto& p: lru)
+    {
+        if (totalBytes + partialBytes <= budget)
+            break;
+        dropEntry(p.first, p.second.size);
+        ++evicted;
+    }
+    evictions += evicted;
+    qCDebug(MAIN) << "Media cache: evicted" << evicted << "entries";
+}
+
+void MediaCache::Private::dropEntry(const QString& mxcUri, QSize size)
+{
+    if (forgetEntry(mxcUri, size))
+        QFile::remove(fileName(mxcUri, size));
+}
+
+bool MediaCache::Private::forgetEntry(const QString& mxcUri, QSize size)
+{
+    const auto uriIt = entries.find(mxcUri);
+    if (uriIt == entries.end())
+        return false;
+    auto& uriEntries = *uriIt;
+    const auto it = std::find_if(uriEntries.begin(), uriEntries.end(),
+                        [size] (const Entry& e) { return e.size == size; });
+    if (it == uriEntries.end())
+        return false;
+    totalBytes -= it->bytes;
+    --entryCount;
+    uriEntries.erase(it);
+    if (uriEntries.empty())
+        entries.erase(uriIt);
+    scheduleSave();
+    return true;
+}
+
+MediaCache& MediaCache::instance()
+{
+    static MediaCache cache;
+    return cache;
+}
+
+MediaCache::MediaCache()
+    : d(std::make_unique<Private>())
+{
+    d->saveTimer.setSingleShot(true);
+    d->saveTimer.setInterval(1000);
+    QObject::connect(&d->saveTimer, &QTimer::timeout,
+                     [this] { d->saveIndex(); });
+    // The cache outlives the application object, so the index should be
+    // flushed while the event loop and the timer are still usable
+    if (auto* app = QCoreApplication::instance())
+        QObject::connect(app, &QCoreApplication::aboutToQuit, &d->saveTimer,
+                         [this] {
+                             d->quitting = true;
+                             if (d->saveTimer.isActive())
+                             {
+                                 d->saveTimer.stop();
+                                 d->saveIndex();
+                             }
+                         });
+    else
+        d->quitting = true;
+    d->loadIndex();
+}
+
+MediaCache::~MediaCache() = default;
+
+QString MediaCache::find(const QUrl& mxcUri, QSize minSize)
+{
+    const auto uri = mxcUri.toString();
+    const auto uriIt = d->entries.find(uri);
+    if (uriIt == d->entries.end())
+    {
+        ++d->misses;
+        return {};
+    }
+    const auto fits = [minSize] (QSize s) {
+        return !s.isValid() || (minSize.isValid()
+                                && s.width() >= minSize.width()
+                                && s.height() >= minSize.height());
+    };
+    const auto area = [] (QSize s) {
+        return s.isValid() ? qint64(s.width()) * s.height()
+                           : std::numeric_limits<qint64>::max();
+    };
+    auto best = uriIt->end();
+    for (auto it = uriIt->begin(); it != uriIt->end(); ++it)
+    {
+        if (best == uriIt->end())
+            best = it;
+        else if (fits(it->size) != fits(best->size))
+        {
+            if (fits(it->size))
+                best = it;
+        }
+        // Among fitting entries, prefer the smallest; among those that
+        // don't fit, prefer the largest
+        else if (fits(it->size) ? area(it->size) < area(best->size)
+                                : area(it->size) > area(best->size))
+            best = it;
+    }
+    // The full content is only good enough if it's been asked for
+    if (best == uriIt->end() || (!minSize.isValid() && best->size.isValid()))
+    {
+        ++d->misses;
+        return {};
+    }
+    ++d->hits;
+    best->lastUsed = QDateTime::currentMSecsSinceEpoch();
+    d->scheduleSave();
+    return d->fileName(uri, best->size);
+}
+
+QString MediaCache::filePath(const QUrl& mxcUri, QSize size) const
+{
+    return d->fileName(mxcUri.toString(), size);
+}
+
+QString MediaCache::partialFilePath(const QUrl& mxcUri, QSize size) const
+{
+    return d->partialFileName(mxcUri.toString(), size);
+}
+
+bool MediaCache::commit(const QUrl& mxcUri, QSize size)
+{
+    const auto uri = mxcUri.toString();
+    const QFileInfo fi { d->partialFileName(uri, size) };
+    if (!fi.exists())
+    {
+        qCWarning(MAIN) << "Media cache: nothing to commit at"
+                        << fi.filePath();
+        return false;
+    }
+    if (fi.size() > d->budget)
+    {
+        qCDebug(MAIN) << "Media cache:" << uri << "takes" << fi.size()
+                      << "bytes, more than the whole budget; not caching it";
+        return false;
+    }
+    const auto fileName = d->fileName(uri, size);
+    QFile::remove(fileName);
+    if (!QFile::rename(fi.filePath(), fileName))
+    {
+        qCWarning(MAIN) << "Media cache: couldn't move" << fi.filePath()
+                        << "to" << fileName;
+        d->forgetEntry(uri, size);
+        return false;
+    }
+    auto& uriEntries = d->entries[uri];
+    auto it = std::find_if(uriEntries.begin(), uriEntries.end(),
+                           [size] (const Private::Entry& e) {
+                               return e.size == size;
+                           });
+    if (it == uriEntries.end())
+    {
+        uriEntries.push_back({ size });
+        it = uriEntries.end() - 1;
+        ++d->entryCount;
+    }
+    d->totalBytes += fi.size() - it->bytes;
+    it->bytes = fi.size();
+    it->lastUsed = QDateTime::currentMSecsSinceEpoch();
+    d->scheduleSave();
+    d->evict();
+    return true;
+}
+
+void MediaCache::remove(const QUrl& mxcUri, QSize size)
+{
+    d->dropEntry(mxcUri.toString(), size);
+}
+
+void MediaCache::clear()
+{
+    for (auto it = d->entries.cbegin(); it != d->entries.cend(); ++it)
+        for (const auto& e: *it)
+            QFile::remove(d->fileName(it.key(), e.size));
+    d->entries.clear();
+    d->entryCount = 0;
+    d->totalBytes = 0;
+    d->saveIndex();
+}
+
+qint64 MediaCache::budget() const
+{
+    return d->budget;
+}
+
+void MediaCache::setBudget(qint64 bytes)
+{
+    d->budget = bytes;
+    d->evict();
+}
+
+MediaCache::Stats MediaCache::stats() const
+{
+    Stats s;
+    s.entries = d->entryCount;
+    s.bytes = d->totalBytes;
+    s.partialBytes = d->partialBytes;
+    s.budget = d->budget;
+    s.hits = d->hits;
+    s.misses = d->misses;
+    s.evictions = d->evictions;
+    return s;
+}
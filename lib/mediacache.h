@@ -0,0 +1,99 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QUrl>
+#include <QtCore/QSize>
+
+#include <memory>
+
+namespace QMatrixClient
+{
+    /** A size-bounded on-disk cache of media content
+     *
+     * The cache is shared by all connections in the process. Entries are
+     * keyed by an mxc URI and the size of the thumbnail; an invalid size
+     * stands for the full content. Files are stored under
+     * cacheLocation("media") and are evicted in the least recently used
+     * order once the total size exceeds the budget. Content larger than
+     * the whole budget is not cached at all. The index survives restarts;
+     * pending changes to it are saved when the application is about to quit.
+     * Files in the cache directory that are not in the index are deleted
+     * when the index is loaded.
+     *
+     * To add an entry, save the content to partialFilePath() and call
+     * commit(). Unfinished files there count towards the budget; those
+     * that haven't changed for a day are considered abandoned and are
+     * deleted at startup and on eviction.
+     */
+    class MediaCache
+    {
+        public:
+            struct Stats
+            {
+                int entries = 0;
+                qint64 bytes = 0;
+                qint64 partialBytes = 0;
+                qint64 budget = 0;
+                int hits = 0;
+                int misses = 0;
+                int evictions = 0;
+            };
+
+            static MediaCache& instance();
+
+            /** Find the best cached entry for the content
+             * \param minSize the size the caller needs; entries with both
+             *        dimensions at least as large are preferred, the full
+             *        content being the last resort among them; if none
+             *        fits, the largest available thumbnail is returned.
+             *        An invalid size requires the full content.
+             * \return the file name of the entry, or an empty string if
+             *         nothing suitable is cached
+             */
+            QString find(const QUrl& mxcUri, QSize minSize = {});
+
+            /// The file name of the entry once it is committed
+            QString filePath(const QUrl& mxcUri, QSize size = {}) const;
+            /// The file name to save the content of a new entry to
+            QString partialFilePath(const QUrl& mxcUri, QSize size = {}) const;
+            /** Move the file saved at partialFilePath() into the cache
+             * \return false if the file is too large to be cached; it is left
+             *         at partialFilePath() then, for the caller to move
+             *         or remove
+             */
+            bool commit(const QUrl& mxcUri, QSize size = {});
+            void remove(const QUrl& mxcUri, QSize size = {});
+            void clear();
+
+            qint64 budget() const;
+            /// Set the maximal total size of cached files, in bytes
+            void setBudget(qint64 bytes);
+
+            Stats stats() const;
+
+            ~MediaCache();
+
+        private:
+            MediaCache();
+
+            class Private;
+            std::unique_ptr<Private> d;
+    };
+}  // namespace QMatrixClient
@@ -23,11 +23,14 @@
 #include "csapi/banning.h"
 #include "csapi/leaving.h"
 #include "csapi/receipts.h"
+#include "csapi/read_markers.h"
 #include "csapi/redaction.h"
 #include "csapi/account-data.h"
 #include "csapi/room_state.h"
 #include "csapi/room_send.h"
 #include "csapi/tags.h"
+#include "csapi/rooms.h"
+#include "csapi/event_context.h"
 #include "events/simplestateevents.h"
 #include "events/roomavatarevent.h"
 #include "events/roommemberevent.h"
@@ -40,20 +43,26 @@
 #include "events/redactionevent.h"
 #include "jobs/mediathumbnailjob.h"
 #include "jobs/downloadfilejob.h"
-#include "jobs/postreadmarkersjob.h"
 #include "avatar.h"
 #include "connection.h"
+#include "downloadmanager.h"
 #include "user.h"
 #include "converters.h"
 #include "syncdata.h"
+#include "stringpool.h"
+#include "eventindex.h"
 
 #include <QtCore/QHash>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QSet>
 #include <QtCore/QStringBuilder> // for efficient string concats (operator%)
 #include <QtCore/QPointer>
 #include <QtCore/QDir>
 #include <QtCore/QTemporaryFile>
+#include <QtCore/QTimer>
 
 #include <array>
+#include <list>
 #include <functional>
 #include <cmath>
 
@@ -66,6 +75,48 @@ using std::llround;
 
 enum EventsPlacement : int { Older = -1, Newer = 1 };
 
+/// GetMembersByRoomJob with the `at` parameter that it lacks
+class GetMembersAtJob : public GetMembersByRoomJob
+{
+    public:
+        GetMembersAtJob(const QString& roomId, const QString& at)
+            : GetMembersByRoomJob(roomId)
+        {
+            if (!at.isEmpty())
+                setRequestQuery(Query { { QStringLiteral("at"), at } });
+        }
+
+    protected:
+        Status parseJson(const QJsonDocument& data) override
+        {
+            EventArena arena;
+            return GetMembersByRoomJob::parseJson(data);
+        }
+};
+
+/// GetRoomEventsJob that allocates the loaded events in an EventArena
+class GetHistoryChunkJob : public GetRoomEventsJob
+{
+    public:
+        using GetRoomEventsJob::GetRoomEventsJob;
+
+    protected:
+        Status parseJson(const QJsonDocument& data) override
+        {
+            EventArena arena;
+            return GetRoomEventsJob::parseJson(data);
+        }
+};
+
+/// A rough estimate of the memory taken by a string
+inline qint64 stringBytes(const QString& s)
+{
+    return qint64(sizeof(QString)) + s.size() * qint64(sizeof(QChar));
+}
+
+/// Memory taken by an entry of a Qt hash, besides its key and value
+constexpr qint64 HashNodeOverhead = 2 * sizeof(void*) + sizeof(uint);
+
 // A workaround for MSVC 2015 that fails with "error C2440: 'return':
 // cannot convert from 'initializer list' to 'QMatrixClient::FileTransferInfo'"
 #if (defined(_MSC_VER) && _MSC_VER < 1910) || (defined(__GNUC__) && __GNUC__ <= 4)
@@ -95,18 +146,38 @@ class Room::Private
         JoinState joinState;
         /// The state of the room at timeline position before-0
         /// \sa timelineBase
-        std::unordered_map<StateEventKey, StateEventPtr> baseState;
+        std::unordered_map<StateEventKey, StateEventHandle> baseState;
         /// The state of the room at timeline position after-maxTimelineIndex()
         /// \sa Room::syncEdge
         QHash<StateEventKey, const StateEventBase*> currentState;
         Timeline timeline;
         PendingEvents unsyncedEvents;
-        QHash<QString, TimelineItem::index_t> eventsIndex;
+        /// Sequence numbers of pending events for matching local echo;
+        /// the numbers don't change when events before them are erased
+        QHash<QString, quint64> pendingEventsByTxnId;
+        QHash<QString, quint64> pendingEventsById;
+        /// The sequence numbers of unsyncedEvents, in the same order
+        std::vector<quint64> pendingSeqs;
+        quint64 nextPendingSeq = 0;
+        int maxEventsInFlight = 1;
+        QSet<QString> txnIdsInFlight;
+        /// The number of records in the outbox journal file
+        int outboxRecords = 0;
+        /// Journal records waiting to be written
+        QByteArray outboxBuffer;
+        QTimer outboxTimer;
+        /// How many times each restored event has been loaded from outbox
+        QHash<QString, int> outboxRestores;
+        /// Restored events are only sent after the first sync
+        bool outboxOnHold = false;
+        EventIndex eventsIndex;
         QString displayname;
         Avatar avatar;
         int highlightCount = 0;
         int notificationCount = 0;
         members_map_t membersMap;
+        /// Same users as in membersMap, for lookups that don't need names
+        QSet<const User*> joinedMembers;
         QList<User*> usersTyping;
         QMultiHash<QString, User*> eventIdReadUsers;
         QList<User*> membersLeft;
@@ -116,10 +187,69 @@ class Room::Private
         QString lastDisplayedEventId;
         QHash<const User*, QString> lastReadEventIds;
         QString serverReadMarker;
+        /// The read marker and receipt are sent to the server coalesced
+        QTimer readMarkersTimer;
+        QString fullyReadToSend;
+        QString receiptToSend;
+        QString lastSentReceipt;
         TagsMap tags;
         std::unordered_map<QString, EventPtr> accountData;
         QString prevBatch;
         QPointer<GetRoomEventsJob> eventsHistoryJob;
+        /// Set when the history beginning at the oldest loaded event has
+        /// been dropped and prevBatch no longer paginates from there
+        bool historyTokenLost = false;
+        /// Timeline handles shared with TimelineSnapshot objects; only
+        /// maintained since the first timeline snapshot
+        _impl::TimelineChunks timelineChunks;
+        bool timelineChunksBuilt = false;
+        /// The state shared with RoomStateSnapshot objects; once built,
+        /// it's updated in place, copying the chunks shared with snapshots
+        _impl::StateChunks stateSnapshot;
+        bool stateSnapshotValid = false;
+        /// State changed since the last snapshot; the handles to timeline
+        /// events are only available once the events are in the timeline
+        QSet<StateEventKey> changedStateKeys;
+        QPointer<GetEventContextJob> historyTokenJob;
+        int historyPrefetchScreens = 0;
+        bool prefetchingHistory = false;
+        /// Events per second scrolled towards the history, smoothed
+        double scrollRate = 0;
+        QElapsedTimer scrollTimer;
+        TimelineItem::index_t lastFirstDisplayedIndex = 0;
+        QPointer<GetMembersAtJob> allMembersJob;
+        bool allMembersLoaded = false;
+        /// Members have been dropped by unloadMembers() and should be
+        /// loaded again once the room is displayed
+        bool membersUnloaded = false;
+
+        /// A stretch of history that is not connected to the timeline
+        struct TimelineFragment
+        {
+            int id;
+            RoomEvents events; ///< The oldest first
+            QString prevBatch; ///< Paginates backwards from events.front()
+            QString nextBatch; ///< Paginates forwards from events.back()
+            QPointer<GetRoomEventsJob> job = nullptr;
+
+            RoomEvents::const_iterator find(const QString& eventId) const
+            {
+                return std::find_if(events.begin(), events.end(),
+                    [&eventId] (const RoomEventPtr& e) {
+                        return e->id() == eventId;
+                    });
+            }
+            bool contains(const QString& eventId) const
+            {
+                return find(eventId) != events.end();
+            }
+        };
+        using fragments_t = std::list<TimelineFragment>;
+        fragments_t fragments;
+        int lastFragmentId = 0;
+        /// Indices of timeline items preceded by a gap, with tokens to
+        /// paginate back into the gap from
+        QHash<TimelineItem::index_t, QString> timelineGaps;
 
         struct FileTransferPrivateInfo
         {
@@ -134,6 +264,8 @@ class Room::Private
             FileTransferInfo::Status status = FileTransferInfo::Started;
             qint64 progress = 0;
             qint64 total = -1;
+            /// Downloads go through DownloadManager and have no job here
+            QPointer<DownloadRequest> download = nullptr;
 
             void update(qint64 p, qint64 t)
             {
@@ -172,7 +304,89 @@ class Room::Private
         /// A point in the timeline corresponding to baseState
         rev_iter_t timelineBase() const { return q->findInTimeline(-1); }
 
+        /// The timeline position of the event, or nullptr if not loaded
+        const TimelineItem::index_t* findIndex(const QString& evtId) const
+        {
+            return eventsIndex.find(evtId, [this] (TimelineItem::index_t i) {
+                return timeline[Timeline::size_type(
+                                    i - timeline.front().index())]->id();
+            });
+        }
+        bool isLoaded(const QString& evtId) const
+        {
+            return findIndex(evtId) != nullptr;
+        }
+
+        /// Compact the event, sharing its ids with the connection's pool
+        void compact(const RoomEvent& e) const
+        {
+            e.compact();
+            e.internIds(connection->idPool());
+        }
+        /// Share the ids of a newly stored event with the connection's
+        /// pool, also compacting it if the connection is set to
+        void prepareForStorage(const RoomEvent& e) const
+        {
+            if (connection->compactEventStorage())
+                e.compact();
+            e.internIds(connection->idPool());
+        }
+        /// The number of handles to the event kept by the timeline chunks
+        /// and the state snapshot, or -1 if a snapshot shares them
+        int cachedHandles(const RoomEvent& e,
+                          const TimelineItem* ti = nullptr) const;
+        /// Whether other threads might be reading the event
+        bool isShared(const TimelineItem& ti) const
+        {
+            const auto cached = cachedHandles(*ti, &ti);
+            return cached < 0 || ti.useCount() > 1 + cached;
+        }
+        bool isShared(const StateEventHandle& h) const
+        {
+            const auto cached = cachedHandles(*h);
+            return cached < 0 || h.use_count() > 1 + cached;
+        }
+
+        void publishTimelineItem(const TimelineItem& ti);
+        template <typename IterT>
+        void publishTimelineItems(IterT from, IterT to)
+        {
+            if (timelineChunksBuilt)
+                for (; from != to; ++from)
+                    publishTimelineItem(*from);
+        }
+        void buildStateSnapshot();
+        void updateStateSnapshot();
+        /// Put the handle to the snapshot, or remove the key if it's null
+        void setStateHandle(const StateEventKey& key, StateEventHandle h);
+        void markStateChanged(const StateEventKey& key)
+        {
+            if (stateSnapshotValid)
+                changedStateKeys.insert(key);
+        }
+        /// Find the handle to the event of the current state
+        StateEventHandle stateHandle(const StateEventKey& key,
+                                     const StateEventBase* evt) const;
+
         void getPreviousContent(int limit = 10);
+        /// Drop the timeline before \p keepFromIndex, folding the state
+        /// events into baseState \return the estimated bytes freed
+        qint64 dropHistoryBefore(TimelineItem::index_t keepFromIndex);
+        void restoreHistoryToken(int limit);
+        void updateScrollRate();
+        void prefetchHistory();
+
+        fragments_t::iterator findFragment(const QString& eventId)
+        {
+            return std::find_if(fragments.begin(), fragments.end(),
+                [&eventId] (const TimelineFragment& f) {
+                    return f.contains(eventId);
+                });
+        }
+        void paginateFragment(int fragmentId, bool backwards, int limit);
+        /// Join two fragments if they overlap, leaving the result in f1
+        static bool joinFragments(TimelineFragment& f1, TimelineFragment& f2);
+        void mergeFragments();
 
         template <typename EventT>
         const EventT* getCurrentState(QString stateKey = {}) const
@@ -218,6 +432,14 @@ class Room::Private
                                           bool force = false);
 
         void markMessagesAsRead(rev_iter_t upToMarker);
+        /// Send the coalesced markers within a second from the first change
+        void scheduleReadMarkers()
+        {
+            if (!readMarkersTimer.isActive())
+                readMarkersTimer.start();
+        }
+        void sendReadMarkers();
+        PostReceiptJob* sendReceipt(const QString& eventId);
 
         QString sendEvent(RoomEventPtr&& event);
 
@@ -228,9 +450,35 @@ class Room::Private
         }
 
         QString doSendEvent(const RoomEvent* pEvent);
-        PendingEvents::iterator findAsPending(const RoomEvent* rawEvtPtr);
-        void onEventSendingFailure(const RoomEvent* pEvent,
-                const QString& txnId, BaseJob* call = nullptr);
+        /// Send as many pending events as the in-flight limit allows
+        void dispatchPendingEvents();
+        QString outboxFileName() const
+        {
+            return connection->stateCachePath() % "outbox_"
+                    % SyncData::fileNameForRoom(id);
+        }
+        /** Append a record to the outbox journal
+         * The outbox is a journal of pending events, one JSON object per
+         * line: {"add": <event>, "restores": <n>} or {"remove": <txnId>}.
+         * Records are written in batches, shortly after they are made;
+         * the journal is rewritten from scratch once removals pile up.
+         */
+        void journalOutbox(const QJsonObject& record);
+        void flushOutbox();
+        void rewriteOutbox();
+        /// Delete the outbox along with the records not written yet
+        void dropOutbox();
+        void loadOutbox();
+        /// Stop holding back pending events restored from the outbox
+        void releaseOutbox();
+        PendingEvents::iterator findPendingBySeq(quint64 seq);
+        PendingEvents::iterator findPendingByTxnId(const QString& txnId);
+        /// Find the pending event a given event from the server is echo of
+        PendingEvents::iterator findEchoOf(const RoomEvent& e);
+        void addPendingEvent(RoomEventPtr&& event);
+        void erasePendingEvent(PendingEvents::iterator it);
+        void onEventSendingFailure(const QString& txnId,
+                                   BaseJob* call = nullptr);
 
         template <typename EvT>
         auto requestSetState(const QString& stateKey, const EvT& event)
@@ -276,6 +524,18 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
     // See "Accessing the Public Class" section in
     // https://marcmutz.wordpress.com/translated-articles/pimp-my-pimpl-%E2%80%94-reloaded/
     d->q = this;
+    d->loadOutbox();
+    if (d->outboxOnHold)
+        connectSingleShot(connection, &Connection::syncDone, this,
+                          [this] { d->releaseOutbox(); });
+    d->readMarkersTimer.setSingleShot(true);
+    d->readMarkersTimer.setInterval(1000);
+    connect(&d->readMarkersTimer, &QTimer::timeout,
+            this, [this] { d->sendReadMarkers(); });
+    d->outboxTimer.setSingleShot(true);
+    d->outboxTimer.setInterval(500);
+    connect(&d->outboxTimer, &QTimer::timeout,
+            this, [this] { d->flushOutbox(); });
     connect(this, &Room::userAdded, this, &Room::memberListChanged);
     connect(this, &Room::userRemoved, this, &Room::memberListChanged);
     connect(this, &Room::memberRenamed, this, &Room::memberListChanged);
@@ -284,6 +544,11 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
 
 Room::~Room()
 {
+    // Connection stops the timers when it's being destroyed itself
+    if (d->readMarkersTimer.isActive())
+        d->sendReadMarkers();
+    if (d->outboxTimer.isActive())
+        d->flushOutbox();
     delete d;
 }
 
@@ -357,6 +622,21 @@ QImage Room::avatar(int width, int height)
     return {};
 }
 
+void Room::prefetchAvatar(int dimension)
+{
+    if (!d->avatar.url().isEmpty())
+    {
+        d->avatar.prefetch(connection(), dimension);
+        return;
+    }
+    for (auto* u: directChatUsers())
+        if (u != localUser())
+        {
+            u->prefetchAvatar(dimension, this);
+            return;
+        }
+}
+
 User* Room::user(const QString& userId) const
 {
     return connection()->user(userId);
@@ -365,7 +645,7 @@ User* Room::user(const QString& userId) const
 JoinState Room::memberJoinState(User* user) const
 {
     return
-        d->membersMap.contains(user->name(this), user) ? JoinState::Join :
+        d->joinedMembers.contains(user) ? JoinState::Join :
         JoinState::Leave;
 }
 
@@ -391,6 +671,8 @@ void Room::Private::setLastReadEvent(User* u, QString eventId)
     auto& storedId = lastReadEventIds[u];
     if (storedId == eventId)
         return;
+    // Read markers of many users point to the same few events
+    eventId = connection->idPool().intern(eventId);
     eventIdReadUsers.remove(storedId, u);
     eventIdReadUsers.insert(eventId, u);
     swap(storedId, eventId);
@@ -399,7 +681,10 @@ void Room::Private::setLastReadEvent(User* u, QString eventId)
     if (isLocalUser(u))
     {
         if (storedId != serverReadMarker)
-            connection->callApi<PostReadMarkersJob>(id, storedId);
+        {
+            fullyReadToSend = storedId;
+            scheduleReadMarkers();
+        }
         emit q->readMarkerMoved(eventId, storedId);
         connection->saveRoomState(q);
     }
@@ -503,13 +788,74 @@ void Room::Private::markMessagesAsRead(rev_iter_t upToMarker)
     {
         if ((*upToMarker)->senderId() != q->localUser()->id())
         {
-            connection->callApi<PostReceiptJob>(id, "m.read",
-                                                (*upToMarker)->id());
+            if ((*upToMarker)->id() != lastSentReceipt)
+            {
+                receiptToSend = (*upToMarker)->id();
+                scheduleReadMarkers();
+            }
             break;
         }
     }
 }
 
+void Room::Private::sendReadMarkers()
+{
+    readMarkersTimer.stop();
+    if (fullyReadToSend == serverReadMarker)
+        fullyReadToSend.clear();
+    if (receiptToSend == lastSentReceipt)
+        receiptToSend.clear();
+    if (fullyReadToSend.isEmpty() && receiptToSend.isEmpty())
+        return;
+
+    // The read markers endpoint needs m.fully_read but can take m.read along
+    const auto receipt = receiptToSend;
+    const auto fullyRead = fullyReadToSend;
+    fullyReadToSend.clear();
+    receiptToSend.clear();
+    if (fullyRead.isEmpty())
+    {
+        sendReceipt(receipt);
+        return;
+    }
+    auto* job = connection->callApi<SetReadMarkerJob>(id, fullyRead, receipt);
+    connect(job, &BaseJob::success, q, [this, receipt] {
+        if (!receipt.isEmpty())
+            lastSentReceipt = receipt;
+    });
+    // Try again with the next change unless there's a newer marker already
+    connect(job, &BaseJob::failure, q, [this, fullyRead, receipt] {
+        if (fullyReadToSend.isEmpty())
+            fullyReadToSend = fullyRead;
+        if (receiptToSend.isEmpty())
+            receiptToSend = receipt;
+    });
+}
+
+PostReceiptJob* Room::Private::sendReceipt(const QString& eventId)
+{
+    if (receiptToSend == eventId)
+        receiptToSend.clear();
+    auto* job = connection->callApi<PostReceiptJob>(id,
+                    QStringLiteral("m.read"), eventId);
+    connect(job, &BaseJob::success, q, [this, eventId] {
+        lastSentReceipt = eventId;
+    });
+    connect(job, &BaseJob::failure, q, [this, eventId] {
+        if (receiptToSend.isEmpty())
+            receiptToSend = eventId;
+    });
+    return job;
+}
+
+void Room::postReceipt(const QString& eventId)
+{
+    if (eventId == d->lastSentReceipt)
+        return;
+    d->receiptToSend = eventId;
+    d->scheduleReadMarkers();
+}
+
 void Room::markMessagesAsRead(QString uptoEventId)
 {
     d->markMessagesAsRead(findInTimeline(uptoEventId));
@@ -571,12 +917,8 @@ Room::rev_iter_t Room::findInTimeline(TimelineItem::index_t index) const
 
 Room::rev_iter_t Room::findInTimeline(const QString& evtId) const
 {
-    if (!d->timeline.empty() && d->eventsIndex.contains(evtId))
-    {
-        auto it = findInTimeline(d->eventsIndex.value(evtId));
-        Q_ASSERT((*it)->id() == evtId);
-        return it;
-    }
+    if (const auto* idx = d->findIndex(evtId))
+        return findInTimeline(*idx);
     return timelineEdge();
 }
 
@@ -596,6 +938,19 @@ void Room::setDisplayed(bool displayed)
     {
         resetHighlightCount();
         resetNotificationCount();
+        d->prefetchHistory();
+        if (d->membersUnloaded)
+            loadMembers();
+        return;
+    }
+    d->sendReadMarkers(); // Don't wait once the user leaves the room
+    if (d->prefetchingHistory)
+    {
+        if (isJobRunning(d->eventsHistoryJob))
+            d->eventsHistoryJob->abandon();
+        d->prefetchingHistory = false;
+        d->scrollRate = 0;
+        d->scrollTimer.invalidate();
     }
 }
 
@@ -616,6 +971,11 @@ void Room::setFirstDisplayedEventId(const QString& eventId)
 
     d->firstDisplayedEventId = eventId;
     emit firstDisplayedEventChanged();
+    if (d->historyPrefetchScreens > 0)
+    {
+        d->updateScrollRate();
+        d->prefetchHistory();
+    }
 }
 
 void Room::setFirstDisplayedEvent(TimelineItem::index_t index)
@@ -966,11 +1326,223 @@ int Room::memberCount() const
     return d->membersMap.size();
 }
 
+bool Room::allMembersLoaded() const
+{
+    return d->allMembersLoaded;
+}
+
 int Room::timelineSize() const
 {
     return int(d->timeline.size());
 }
 
+MemoryUsage Room::memoryUsage() const
+{
+    QElapsedTimer et; et.start();
+    MemoryUsage usage;
+    for (const auto& ti: d->timeline)
+        usage.timelineEvents += ti->jsonSize();
+    usage.timelineEvents += d->eventsIndex.memoryUsage()
+        + d->timelineChunks.size() * qint64(_impl::TimelineChunkSize
+                                            * sizeof(RoomEventHandle));
+    for (const auto& f: d->fragments)
+        for (const auto& e: f.events)
+            usage.timelineEvents += e->jsonSize();
+    for (const auto& p: d->baseState)
+        if (p.second)
+            (is<RoomMemberEvent>(*p.second) ? usage.members
+                                            : usage.stateEvents)
+                += p.second->jsonSize();
+    for (auto it = d->membersMap.cbegin(); it != d->membersMap.cend(); ++it)
+        usage.members += HashNodeOverhead + stringBytes(it.key())
+                         + qint64(sizeof(User*));
+    for (auto it = d->eventIdReadUsers.cbegin();
+         it != d->eventIdReadUsers.cend(); ++it)
+        usage.receipts += HashNodeOverhead + stringBytes(it.key())
+                          + qint64(sizeof(User*));
+    for (auto it = d->lastReadEventIds.cbegin();
+         it != d->lastReadEventIds.cend(); ++it)
+        usage.receipts += HashNodeOverhead + qint64(sizeof(User*))
+                          + stringBytes(it.value());
+    usage.avatars = d->avatar.decodedBytes();
+    for (const auto& e: d->unsyncedEvents)
+        usage.pendingEvents += e->jsonSize();
+    if (et.nsecsElapsed() >= profilerMinNsecs())
+        qCDebug(PROFILER) << "*** Room::memoryUsage():" << usage.total()
+                          << "bytes," << et;
+    return usage;
+}
+
+void Room::Private::publishTimelineItem(const TimelineItem& ti)
+{
+    if (!timelineChunksBuilt)
+        return;
+    const auto key = _impl::timelineChunkKey(ti.index());
+    // Detaches the map from snapshots, if it's shared with any
+    auto& chunk = timelineChunks[key];
+    if (!chunk)
+        chunk = std::make_shared<_impl::TimelineChunk>(
+                    _impl::TimelineChunkSize);
+    else if (chunk.use_count() > 1) // Copy on write
+        chunk = std::make_shared<_impl::TimelineChunk>(*chunk);
+    (*chunk)[size_t(ti.index() - key * _impl::TimelineChunkSize)] =
+            ti.handle();
+}
+
+StateEventHandle Room::Private::stateHandle(const StateEventKey& key,
+                                            const StateEventBase* evt) const
+{
+    // The event is either in the base state or in the timeline
+    const auto baseIt = baseState.find(key);
+    if (baseIt != baseState.end() && baseIt->second.get() == evt)
+        return baseIt->second;
+    if (const auto* idx = findIndex(evt->id()))
+    {
+        const auto& ti =
+            timeline[Timeline::size_type(*idx - q->minTimelineIndex())];
+        if (ti.get() == evt)
+            return std::static_pointer_cast<const StateEventBase>(
+                        ti.handle());
+    }
+    return {};
+}
+
+void Room::Private::buildStateSnapshot()
+{
+    stateSnapshot.clear();
+    for (auto it = currentState.cbegin(); it != currentState.cend(); ++it)
+        if (auto h = stateHandle(it.key(), it.value()))
+            setStateHandle(it.key(), move(h));
+    changedStateKeys.clear();
+    stateSnapshotValid = true;
+}
+
+void Room::Private::updateStateSnapshot()
+{
+    for (const auto& key: qAsConst(changedStateKeys))
+    {
+        const auto* evt = currentState.value(key);
+        setStateHandle(key, evt ? stateHandle(key, evt) : StateEventHandle());
+    }
+    changedStateKeys.clear();
+}
+
+void Room::Private::setStateHandle(const StateEventKey& key,
+                                   StateEventHandle h)
+{
+    const auto chunkKey = _impl::stateChunkKey(key);
+    if (!h)
+    {
+        const auto chunk = stateSnapshot.value(chunkKey);
+        if (!chunk || !chunk->contains(key))
+            return;
+    }
+    // Detaches the map from snapshots, if it's shared with any
+    auto& chunk = stateSnapshot[chunkKey];
+    if (!chunk)
+        chunk = std::make_shared<_impl::StateChunk>();
+    else if (chunk.use_count() > 1) // Copy on write
+        chunk = std::make_shared<_impl::StateChunk>(*chunk);
+    if (h)
+        chunk->insert(key, move(h));
+    else
+        chunk->remove(key);
+}
+
+int Room::Private::cachedHandles(const RoomEvent& e,
+                                 const TimelineItem* ti) const
+{
+    int count = 0;
+    if (ti && timelineChunksBuilt)
+    {
+        const auto it =
+            timelineChunks.constFind(_impl::timelineChunkKey(ti->index()));
+        if (it != timelineChunks.cend() && *it)
+        {
+            if (!timelineChunks.isDetached() || it->use_count() > 1)
+                return -1;
+            ++count;
+        }
+    }
+    if (stateSnapshotValid && e.isStateEvent())
+    {
+        const StateEventKey key { e.matrixType(), e.stateKey() };
+        const auto chunkIt =
+            stateSnapshot.constFind(_impl::stateChunkKey(key));
+        if (chunkIt != stateSnapshot.cend() && *chunkIt)
+        {
+            const auto it = (*chunkIt)->constFind(key);
+            if (it != (*chunkIt)->cend() && it->get() == &e)
+            {
+                if (!stateSnapshot.isDetached()
+                        || chunkIt->use_count() > 1)
+                    return -1;
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+RoomStateSnapshot Room::stateSnapshot() const
+{
+    if (!d->stateSnapshotValid)
+    {
+        QElapsedTimer et; et.start();
+        d->buildStateSnapshot();
+        if (et.nsecsElapsed() >= profilerMinNsecs())
+            qCDebug(PROFILER) << "*** Room::stateSnapshot():"
+                              << d->currentState.size() << "event(s)," << et;
+    } else
+        d->updateStateSnapshot();
+    RoomStateSnapshot snapshot;
+    snapshot._roomId = id();
+    snapshot._chunks = d->stateSnapshot;
+    return snapshot;
+}
+
+TimelineSnapshot Room::timelineSnapshot(TimelineItem::index_t from,
+                                        TimelineItem::index_t to) const
+{
+    if (!d->timelineChunksBuilt)
+    {
+        QElapsedTimer et; et.start();
+        d->timelineChunksBuilt = true;
+        d->publishTimelineItems(d->timeline.cbegin(), d->timeline.cend());
+        if (et.nsecsElapsed() >= profilerMinNsecs())
+            qCDebug(PROFILER) << "*** Room::timelineSnapshot():"
+                              << d->timeline.size() << "event(s)," << et;
+    }
+    TimelineSnapshot snapshot;
+    snapshot._roomId = id();
+    if (d->timeline.empty())
+        return snapshot;
+    snapshot._chunks = d->timelineChunks;
+    snapshot._minIndex = std::max(from, minTimelineIndex());
+    snapshot._maxIndex = std::min(to, maxTimelineIndex());
+    return snapshot;
+}
+
+TimelineSnapshot Room::timelineSnapshot() const
+{
+    return timelineSnapshot(minTimelineIndex(), maxTimelineIndex());
+}
+
+void Room::compactEvents() const
+{
+    QElapsedTimer et; et.start();
+    for (const auto& ti: d->timeline)
+        if (!d->isShared(ti))
+            d->compact(*ti);
+    for (const auto& p: d->baseState)
+        if (p.second && !d->isShared(p.second))
+            d->compact(*p.second);
+    if (et.nsecsElapsed() >= profilerMinNsecs())
+        qCDebug(PROFILER) << "*** Room::compactEvents():"
+                          << d->timeline.size() + d->baseState.size()
+                          << "event(s)," << et;
+}
+
 bool Room::usesEncryption() const
 {
     return !d->getCurrentState<EncryptionEvent>()->algorithm().isEmpty();
@@ -981,6 +1553,199 @@ GetRoomEventsJob* Room::eventsHistoryJob() const
     return d->eventsHistoryJob;
 }
 
+void Room::loadMembers()
+{
+    if (d->allMembersLoaded || isJobRunning(d->allMembersJob))
+        return;
+
+    auto* job = connection()->callApi<GetMembersAtJob>(BackgroundRequest,
+                    id(), connection()->nextBatchToken());
+    d->allMembersJob = job;
+    connect(job, &BaseJob::success, this, [this, job] {
+        QElapsedTimer et; et.start();
+        auto members = job->chunk();
+        d->membersMap.reserve(int(members.size()));
+        d->joinedMembers.reserve(int(members.size()));
+        Changes changes = Change::NoChange;
+        for (auto&& e: members)
+        {
+            const StateEventKey key { e->matrixType(), e->stateKey() };
+            // Member events that came with syncs are at least as recent
+            if (d->currentState.contains(key))
+                continue;
+            const auto& evt = *e;
+            d->baseState[key] = move(e);
+            changes |= processStateEvent(evt);
+            d->prepareForStorage(evt);
+        }
+        d->allMembersLoaded = true;
+        d->membersUnloaded = false;
+        qCDebug(PROFILER) << "*** Room::loadMembers():" << members.size()
+                          << "member(s)," << et;
+        if (changes != Change::NoChange)
+        {
+            d->updateDisplayname();
+            emit changed(changes);
+        }
+        emit membersLoaded();
+        connection()->saveRoomState(this);
+    });
+}
+
+qint64 Room::unloadMembers()
+{
+    // Without a name, the display name of the room depends on its members
+    if (d->displayed || joinState() != JoinState::Join ||
+            (name().isEmpty() && canonicalAlias().isEmpty()))
+        return 0;
+
+    if (isJobRunning(d->allMembersJob))
+        d->allMembersJob->abandon();
+    QSet<const User*> usersToKeep { localUser() };
+    for (const auto& ti: d->timeline)
+        usersToKeep.insert(user(ti->senderId()));
+    for (auto* u: directChatUsers())
+        usersToKeep.insert(u);
+    for (auto* u: d->usersTyping)
+        usersToKeep.insert(u);
+
+    qint64 bytesFreed = 0;
+    int unloadedCount = 0;
+    for (auto it = d->baseState.begin(); it != d->baseState.end();)
+    {
+        const auto* evt = eventCast<const RoomMemberEvent>(it->second);
+        auto* u = evt ? user(evt->userId()) : nullptr;
+        // Members changed by timeline events are needed for the timeline
+        if (!u || usersToKeep.contains(u) ||
+                d->currentState.value(it->first) != evt)
+        {
+            ++it;
+            continue;
+        }
+        const auto userName = u->name(this);
+        if (d->membersMap.contains(userName, u))
+            d->removeMemberFromMap(userName, u);
+        d->membersLeft.removeOne(u);
+        d->currentState.remove(it->first);
+        if (d->stateSnapshotValid)
+        {
+            d->setStateHandle(it->first, {});
+            d->changedStateKeys.remove(it->first);
+        }
+        bytesFreed += evt->jsonSize();
+        ++unloadedCount;
+        it = d->baseState.erase(it);
+    }
+    if (unloadedCount == 0)
+        return 0;
+
+    d->allMembersLoaded = false;
+    d->membersUnloaded = true;
+    qCDebug(MAIN) << "Room" << d->displayname << "unloaded" << unloadedCount
+                  << "member(s)";
+    emit memberListChanged();
+    return bytesFreed;
+}
+
+qint64 Room::trimHistory()
+{
+    const auto readMarkerIt = readMarker();
+    if (readMarkerIt == timelineEdge())
+        return 0; // The whole local timeline is unread
+
+    auto keepFromIndex = readMarkerIt->index();
+    const auto firstDisplayedIt = firstDisplayedMarker();
+    if (d->displayed && firstDisplayedIt != timelineEdge())
+        keepFromIndex = std::min(keepFromIndex, firstDisplayedIt->index());
+    if (keepFromIndex <= minTimelineIndex() && d->fragments.empty())
+        return 0;
+
+    QElapsedTimer et; et.start();
+    qint64 bytesFreed = 0;
+    for (auto& f: d->fragments)
+    {
+        if (isJobRunning(f.job))
+            f.job->abandon();
+        for (const auto& e: f.events)
+            bytesFreed += e->jsonSize();
+    }
+    d->fragments.clear();
+    const auto dropCount = keepFromIndex - minTimelineIndex();
+    if (dropCount <= 0)
+        return bytesFreed;
+
+    bytesFreed += d->dropHistoryBefore(keepFromIndex);
+    d->historyTokenLost = true;
+    qCDebug(PROFILER) << "*** Room::trimHistory():" << dropCount
+                      << "event(s)," << bytesFreed << "bytes," << et;
+    return bytesFreed;
+}
+
+qint64 Room::Private::dropHistoryBefore(TimelineItem::index_t keepFromIndex)
+{
+    const auto dropCount = keepFromIndex - q->minTimelineIndex();
+    Q_ASSERT(dropCount > 0 && q->isValidIndex(keepFromIndex));
+    if (isJobRunning(eventsHistoryJob))
+        eventsHistoryJob->abandon();
+    if (isJobRunning(historyTokenJob))
+        historyTokenJob->abandon();
+    prefetchingHistory = false;
+
+    emit q->aboutToTrimHistory(keepFromIndex);
+    qint64 bytesFreed = 0;
+    const auto dropEnd = timeline.begin() + dropCount;
+    for (auto it = timeline.begin(); it != dropEnd; ++it)
+    {
+        const auto& evt = **it;
+        eventsIndex.remove(evt.id(), it->index());
+        if (!evt.isStateEvent())
+        {
+            bytesFreed += evt.jsonSize();
+            continue;
+        }
+        // State events become a part of the state before the timeline
+        const StateEventKey key { evt.matrixType(), evt.stateKey() };
+        auto& baseEvt = baseState[key];
+        if (baseEvt)
+        {
+            bytesFreed += baseEvt->jsonSize();
+            if (currentState.value(key) == baseEvt.get())
+            {
+                currentState[key] = static_cast<const StateEventBase*>(&evt);
+                markStateChanged(key);
+            }
+        }
+        baseEvt = std::static_pointer_cast<const StateEventBase>(
+                      it->replaceEvent({}));
+    }
+    timeline.erase(timeline.begin(), dropEnd);
+    eventsIndex.squeeze();
+    // Existing snapshots keep their chunks; new ones start afresh
+    timelineChunks.clear();
+    timelineChunksBuilt = false;
+    for (auto it = timelineGaps.begin(); it != timelineGaps.end();)
+        if (it.key() <= keepFromIndex)
+            it = timelineGaps.erase(it);
+        else
+            ++it;
+    emit q->historyTrimmed();
+    return bytesFreed;
+}
+
+void Room::fillGap(TimelineItem::index_t index, int limit)
+{
+    const auto gapIt = d->timelineGaps.constFind(index);
+    if (gapIt == d->timelineGaps.cend())
+        return;
+    const auto from = *gapIt;
+    // Events can't be inserted mid-timeline, so the history before the gap
+    // is dropped, to be loaded again after the gap is filled
+    d->dropHistoryBefore(index);
+    d->prevBatch = from;
+    d->historyTokenLost = false;
+    getPreviousContent(limit);
+}
+
 void Room::Private::insertMemberIntoMap(User *u)
 {
     const auto userName = u->name(q);
@@ -991,6 +1756,7 @@ void Room::Private::insertMemberIntoMap(User *u)
         emit q->memberAboutToRename(namesakes.front(),
                                     namesakes.front()->fullName(q));
     membersMap.insert(userName, u);
+    joinedMembers.insert(u);
     if (namesakes.size() == 1)
         emit q->memberRenamed(namesakes.front());
 }
@@ -1022,6 +1788,7 @@ void Room::Private::removeMemberFromMap(const QString& username, User* u)
         emit q->memberAboutToRename(namesake, username);
     }
     membersMap.remove(username, u);
+    joinedMembers.remove(u);
     // If there was one namesake besides the removed user, signal member renaming
     // for it because it doesn't need to be disambiguated anymore.
     // TODO: Think about left users.
@@ -1038,6 +1805,8 @@ Room::Timeline::difference_type Room::Private::moveEventsToTimeline(
     RoomEventsRange events, EventsPlacement placement)
 {
     Q_ASSERT(!events.empty());
+    // Handles to the events loaded together are allocated together, too
+    EventArena arena;
     // Historical messages arrive in newest-to-oldest order, so the process for
     // them is almost symmetric to the one for new messages. New messages get
     // appended from index 0; old messages go backwards from index -1.
@@ -1045,6 +1814,7 @@ Room::Timeline::difference_type Room::Private::moveEventsToTimeline(
                  placement == Older ? timeline.front().index() :
                  timeline.back().index();
     auto baseIndex = index;
+    eventsIndex.reserve(eventsIndex.size() + int(events.size()));
     for (auto&& e: events)
     {
         const auto eId = e->id();
@@ -1052,7 +1822,7 @@ Room::Timeline::difference_type Room::Private::moveEventsToTimeline(
         Q_ASSERT_X(!eId.isEmpty(), __FUNCTION__,
                    makeErrorStr(*e,
                     "Event with empty id cannot be in the timeline"));
-        Q_ASSERT_X(!eventsIndex.contains(eId), __FUNCTION__,
+        Q_ASSERT_X(!isLoaded(eId), __FUNCTION__,
                    makeErrorStr(*e, "Event is already in the timeline; "
                        "incoming events were not properly deduplicated"));
         if (placement == Older)
@@ -1112,6 +1882,8 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
 {
     if( d->prevBatch.isEmpty() )
         d->prevBatch = data.timelinePrevBatch;
+    if (data.membersLoaded)
+        d->allMembersLoaded = true;
     setJoinState(data.joinState);
 
     Changes roomChanges = Change::NoChange;
@@ -1128,6 +1900,7 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
             Q_ASSERT(evt.isStateEvent());
             d->baseState[{evt.matrixType(),evt.stateKey()}] = move(eptr);
             roomChanges |= processStateEvent(evt);
+            d->prepareForStorage(evt);
         }
 
         if (data.state.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
@@ -1137,7 +1910,14 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     if (!data.timeline.empty())
     {
         et.restart();
+        // A limited timeline that doesn't connect to the loaded events
+        // leaves a gap behind; remember where it is.
+        const bool hasGap = data.timelineLimited && !d->timeline.empty() &&
+                !d->isLoaded(data.timeline.front()->id());
+        const auto gapIndex = maxTimelineIndex() + 1;
         roomChanges |= d->addNewMessageEvents(move(data.timeline));
+        if (hasGap && maxTimelineIndex() >= gapIndex)
+            d->timelineGaps.insert(gapIndex, data.timelinePrevBatch);
         if (data.timeline.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
             qCDebug(PROFILER) << "*** Room::addNewMessageEvents():"
                               << data.timeline.size() << "event(s)," << et;
@@ -1179,27 +1959,221 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     }
 }
 
+inline QJsonObject outboxJson(const RoomEvent& evt)
+{
+    auto json = evt.originalJsonObject();
+    // The event will be sent anew, with the same transaction id
+    json.remove(EventIdKey);
+    return json;
+}
+
 QString Room::Private::sendEvent(RoomEventPtr&& event)
 {
     if (event->transactionId().isEmpty())
         event->setTransactionId(connection->generateTxnId());
-    auto* pEvent = rawPtr(event);
+    auto txnId = event->transactionId();
     emit q->pendingEventAboutToAdd();
-    unsyncedEvents.emplace_back(move(event));
+    addPendingEvent(move(event));
+    journalOutbox({{ "add", outboxJson(*unsyncedEvents.back()) }});
     emit q->pendingEventAdded();
-    return doSendEvent(pEvent);
+    dispatchPendingEvents();
+    return txnId;
+}
+
+void Room::Private::dispatchPendingEvents()
+{
+    if (outboxOnHold)
+        return;
+    for (const auto& pe: unsyncedEvents)
+    {
+        if (txnIdsInFlight.size() >= maxEventsInFlight)
+            break;
+        // Don't let further events overtake the failed one
+        if (pe.deliveryStatus() == EventStatus::SendingFailed)
+            break;
+        if (pe.deliveryStatus() == EventStatus::Submitted &&
+                !txnIdsInFlight.contains(pe->transactionId()))
+            doSendEvent(pe.event());
+    }
+}
+
+void Room::Private::journalOutbox(const QJsonObject& record)
+{
+    if (!connection->cacheState())
+        return;
+
+    outboxBuffer += QJsonDocument(record).toJson(QJsonDocument::Compact)
+                    + '\n';
+    ++outboxRecords;
+    if (!outboxTimer.isActive())
+        outboxTimer.start();
+}
+
+void Room::Private::flushOutbox()
+{
+    outboxTimer.stop();
+    if (outboxBuffer.isEmpty())
+        return;
+    // Rewriting is cheaper than replaying lots of stale records
+    if (unsyncedEvents.empty() ||
+            outboxRecords >= 2 * int(unsyncedEvents.size()) + 16)
+    {
+        rewriteOutbox();
+        return;
+    }
+    QFile outboxFile { outboxFileName() };
+    if (!outboxFile.open(QFile::WriteOnly | QFile::Append))
+    {
+        qCWarning(MAIN) << "Error opening" << outboxFile.fileName()
+                        << ":" << outboxFile.errorString();
+        return;
+    }
+    outboxFile.write(outboxBuffer);
+    outboxBuffer.clear();
+}
+
+void Room::Private::dropOutbox()
+{
+    outboxTimer.stop();
+    outboxBuffer.clear();
+    outboxRecords = 0;
+    QFile::remove(outboxFileName());
+}
+
+void Room::Private::rewriteOutbox()
+{
+    outboxTimer.stop();
+    outboxBuffer.clear();
+    if (!connection->cacheState())
+        return;
+
+    QFile outboxFile { outboxFileName() };
+    outboxRecords = 0;
+    if (unsyncedEvents.empty())
+    {
+        if (outboxFile.exists())
+            outboxFile.remove();
+        return;
+    }
+    if (!outboxFile.open(QFile::WriteOnly))
+    {
+        qCWarning(MAIN) << "Error opening" << outboxFile.fileName()
+                        << ":" << outboxFile.errorString();
+        return;
+    }
+    for (const auto& pe: unsyncedEvents)
+    {
+        QJsonObject record { { "add", outboxJson(*pe) } };
+        const auto restores = outboxRestores.value(pe->transactionId());
+        if (restores > 0)
+            record.insert("restores", restores);
+        outboxFile.write(QJsonDocument(record).toJson(QJsonDocument::Compact)
+                         + '\n');
+        ++outboxRecords;
+    }
+}
+
+/// Events restored more times than this are considered undeliverable
+/// and are only sent again upon retryMessage()
+static const auto MaxOutboxRestores = 3;
+
+void Room::Private::loadOutbox()
+{
+    if (!connection->cacheState())
+        return;
+
+    QFile outboxFile { outboxFileName() };
+    if (!outboxFile.exists() || !outboxFile.open(QFile::ReadOnly))
+        return;
+    // Replay the journal; the order of "add" records is the sending order
+    std::vector<std::pair<QJsonObject, int>> events;
+    const auto findTxn = [&events] (const QString& txnId) {
+        return std::find_if(events.begin(), events.end(),
+            [&txnId] (const auto& e) {
+                return e.first.value(UnsignedKeyL).toObject()
+                        .value("transaction_id"_ls).toString() == txnId;
+            });
+    };
+    while (!outboxFile.atEnd())
+    {
+        const auto record =
+            QJsonDocument::fromJson(outboxFile.readLine()).object();
+        if (record.contains("remove"))
+        {
+            const auto it = findTxn(record.value("remove").toString());
+            if (it != events.end())
+                events.erase(it);
+        } else if (record.contains("add"))
+        {
+            std::pair<QJsonObject, int> e { record.value("add").toObject(),
+                                            record.value("restores").toInt() };
+            // A retried event is added again in its old place
+            const auto it = findTxn(e.first.value(UnsignedKeyL).toObject()
+                                    .value("transaction_id"_ls).toString());
+            if (it != events.end())
+                *it = move(e);
+            else
+                events.push_back(move(e));
+        }
+    }
+    outboxFile.close();
+    for (const auto& e: events)
+    {
+        auto evt = loadEvent<RoomEvent>(e.first);
+        if (!evt || evt->transactionId().isEmpty())
+            continue;
+        const auto restores = std::min(e.second + 1, MaxOutboxRestores + 1);
+        outboxRestores.insert(evt->transactionId(), restores);
+        addPendingEvent(move(evt));
+        if (restores > MaxOutboxRestores)
+        {
+            qCWarning(MAIN) << "Pending event"
+                            << unsyncedEvents.back()->transactionId() << "in"
+                            << id << "was not delivered after" << e.second
+                            << "restarts";
+            unsyncedEvents.back().setSendingFailed(
+                QStringLiteral("Not delivered after %1 restarts")
+                    .arg(e.second));
+        }
+    }
+    rewriteOutbox();
+    if (unsyncedEvents.empty())
+        return;
+
+    qCDebug(MAIN) << "Restored" << unsyncedEvents.size()
+                  << "pending event(s) in" << id;
+    // Events that reached the server before the restart may come back with
+    // the next sync; only the rest should be sent again
+    outboxOnHold = true;
+}
+
+void Room::Private::releaseOutbox()
+{
+    outboxOnHold = false;
+    dispatchPendingEvents();
+}
+
+int Room::maxEventsInFlight() const
+{
+    return d->maxEventsInFlight;
+}
+
+void Room::setMaxEventsInFlight(int newMax)
+{
+    d->maxEventsInFlight = std::max(newMax, 1);
+    d->dispatchPendingEvents();
 }
 
 QString Room::Private::doSendEvent(const RoomEvent* pEvent)
 {
     auto txnId = pEvent->transactionId();
-    // TODO, #133: Enqueue the job rather than immediately trigger it.
     if (auto call = connection->callApi<SendMessageJob>(BackgroundRequest,
                         id, pEvent->matrixType(), txnId, pEvent->contentJson()))
     {
+        txnIdsInFlight.insert(txnId);
         Room::connect(call, &BaseJob::started, q,
-            [this,pEvent,txnId] {
-                auto it = findAsPending(pEvent);
+            [this,txnId] {
+                auto it = findPendingByTxnId(txnId);
                 if (it == unsyncedEvents.end())
                 {
                     qWarning(EVENTS) << "Pending event for transaction" << txnId
@@ -1210,13 +2184,15 @@ QString Room::Private::doSendEvent(const RoomEvent* pEvent)
                 emit q->pendingEventChanged(it - unsyncedEvents.begin());
             });
         Room::connect(call, &BaseJob::failure, q,
-            std::bind(&Room::Private::onEventSendingFailure,
-                      this, pEvent, txnId, call));
+            [this,call,txnId] {
+                txnIdsInFlight.remove(txnId);
+                onEventSendingFailure(txnId, call);
+            });
         Room::connect(call, &BaseJob::success, q,
-            [this,call,pEvent,txnId] {
-                // Find an event by the pointer saved in the lambda (the pointer
-                // may be dangling by now but we can still search by it).
-                auto it = findAsPending(pEvent);
+            [this,call,txnId] {
+                txnIdsInFlight.remove(txnId);
+                dispatchPendingEvents();
+                auto it = findPendingByTxnId(txnId);
                 if (it == unsyncedEvents.end())
                 {
                     qDebug(EVENTS) << "Pending event for transaction" << txnId
@@ -1224,27 +2200,99 @@ QString Room::Private::doSendEvent(const RoomEvent* pEvent)
                     return;
                 }
 
+                // A restored event may have been synced before the restart;
+                // the server gives it the same id again then
+                if (isLoaded(call->eventId()))
+                {
+                    qCDebug(EVENTS) << "Pending event for transaction"
+                                    << txnId << "is already in the timeline";
+                    const auto idx = int(it - unsyncedEvents.begin());
+                    emit q->pendingEventAboutToDiscard(idx);
+                    erasePendingEvent(it);
+                    emit q->pendingEventDiscarded();
+                    return;
+                }
                 it->setReachedServer(call->eventId());
+                pendingEventsById.insert(call->eventId(),
+                    pendingSeqs[size_t(it - unsyncedEvents.begin())]);
                 emit q->pendingEventChanged(it - unsyncedEvents.begin());
             });
     } else
-        onEventSendingFailure(pEvent, txnId);
+        onEventSendingFailure(txnId);
     return txnId;
 }
 
-Room::PendingEvents::iterator Room::Private::findAsPending(
-        const RoomEvent* rawEvtPtr)
+Room::PendingEvents::iterator Room::Private::findPendingBySeq(quint64 seq)
+{
+    const auto it = std::lower_bound(pendingSeqs.begin(), pendingSeqs.end(),
+                                     seq);
+    if (it == pendingSeqs.end() || *it != seq)
+        return unsyncedEvents.end();
+    return unsyncedEvents.begin() + (it - pendingSeqs.begin());
+}
+
+Room::PendingEvents::iterator Room::Private::findPendingByTxnId(
+        const QString& txnId)
+{
+    const auto seqIt = pendingEventsByTxnId.constFind(txnId);
+    return seqIt != pendingEventsByTxnId.cend() ? findPendingBySeq(*seqIt)
+                                                : unsyncedEvents.end();
+}
+
+Room::PendingEvents::iterator Room::Private::findEchoOf(const RoomEvent& e)
+{
+    if (unsyncedEvents.empty())
+        return unsyncedEvents.end();
+
+    // Pending events always have transaction ids, and get event ids
+    // once they reach the server; so no need to compare contents.
+    auto it = unsyncedEvents.end();
+    const auto& eventId = e.id();
+    if (!eventId.isEmpty())
+    {
+        const auto seqIt = pendingEventsById.constFind(eventId);
+        if (seqIt != pendingEventsById.cend())
+            it = findPendingBySeq(*seqIt);
+    }
+    if (it == unsyncedEvents.end())
+    {
+        const auto& txnId = e.transactionId();
+        if (!txnId.isEmpty())
+            it = findPendingByTxnId(txnId);
+    }
+    if (it == unsyncedEvents.end())
+        return it;
+    return (*it)->type() == e.type() ? it : unsyncedEvents.end();
+}
+
+void Room::Private::addPendingEvent(RoomEventPtr&& event)
 {
-    const auto comp =
-        [rawEvtPtr] (const auto& pe) { return pe.event() == rawEvtPtr; };
+    Q_ASSERT(!event->transactionId().isEmpty());
+    const auto seq = nextPendingSeq++;
+    pendingEventsByTxnId.insert(event->transactionId(), seq);
+    if (!event->id().isEmpty())
+        pendingEventsById.insert(event->id(), seq);
+    pendingSeqs.push_back(seq);
+    unsyncedEvents.emplace_back(move(event));
+}
 
-    return std::find_if(unsyncedEvents.begin(), unsyncedEvents.end(), comp);
+void Room::Private::erasePendingEvent(PendingEvents::iterator it)
+{
+    const auto pos = it - unsyncedEvents.begin();
+    const auto txnId = (*it)->transactionId();
+    pendingEventsByTxnId.remove(txnId);
+    if (!(*it)->id().isEmpty())
+        pendingEventsById.remove((*it)->id());
+    unsyncedEvents.erase(it);
+    pendingSeqs.erase(pendingSeqs.begin() + pos);
+    outboxRestores.remove(txnId);
+    journalOutbox({{ "remove", txnId }});
 }
 
-void Room::Private::onEventSendingFailure(const RoomEvent* pEvent,
-        const QString& txnId, BaseJob* call)
+void Room::Private::onEventSendingFailure(const QString& txnId,
+                                          BaseJob* call)
 {
-    auto it = findAsPending(pEvent);
+    auto it = findPendingByTxnId(txnId);
     if (it == unsyncedEvents.end())
     {
         qCritical(EVENTS) << "Pending event for transaction" << txnId
@@ -1259,23 +2307,28 @@ void Room::Private::onEventSendingFailure(const RoomEvent* pEvent,
 
 QString Room::retryMessage(const QString& txnId)
 {
-    auto it = std::find_if(d->unsyncedEvents.begin(), d->unsyncedEvents.end(),
-            [txnId] (const auto& evt) { return evt->transactionId() == txnId; });
+    auto it = d->findPendingByTxnId(txnId);
     Q_ASSERT(it != d->unsyncedEvents.end());
     qDebug(EVENTS) << "Retrying transaction" << txnId;
+    // An explicit retry gives an undeliverable event another round
+    // of restarts
+    if (d->outboxRestores.remove(txnId) > 0)
+        d->journalOutbox({{ "add", outboxJson(**it) }});
     it->resetStatus();
-    return d->doSendEvent(it->event());
+    emit pendingEventChanged(it - d->unsyncedEvents.begin());
+    d->dispatchPendingEvents();
+    return txnId;
 }
 
 void Room::discardMessage(const QString& txnId)
 {
-    auto it = std::find_if(d->unsyncedEvents.begin(), d->unsyncedEvents.end(),
-            [txnId] (const auto& evt) { return evt->transactionId() == txnId; });
+    auto it = d->findPendingByTxnId(txnId);
     Q_ASSERT(it != d->unsyncedEvents.end());
     qDebug(EVENTS) << "Discarding transaction" << txnId;
     emit pendingEventAboutToDiscard(it - d->unsyncedEvents.begin());
-    d->unsyncedEvents.erase(it);
+    d->erasePendingEvent(it);
     emit pendingEventDiscarded();
+    d->dispatchPendingEvents();
 }
 
 QString Room::postMessage(const QString& plainText, MessageEventType type)
@@ -1331,26 +2384,6 @@ void Room::setTopic(const QString& newTopic)
     d->requestSetState(RoomTopicEvent(newTopic));
 }
 
-bool isEchoEvent(const RoomEventPtr& le, const PendingEventItem& re)
-{
-    if (le->type() != re->type())
-        return false;
-
-    if (!re->id().isEmpty())
-        return le->id() == re->id();
-    if (!re->transactionId().isEmpty())
-        return le->transactionId() == re->transactionId();
-
-    // This one is not reliable (there can be two unsynced
-    // events with the same type, sender and state key) but
-    // it's the best we have for state events.
-    if (re->isStateEvent())
-        return le->stateKey() == re->stateKey();
-
-    // Empty id and no state key, hmm... (shrug)
-    return le->contentJson() == re->contentJson();
-}
-
 bool Room::supportsCalls() const
 {
   return d->membersMap.size() == 2;
@@ -1396,20 +2429,287 @@ void Room::getPreviousContent(int limit)
 
 void Room::Private::getPreviousContent(int limit)
 {
+    if (historyTokenLost)
+    {
+        restoreHistoryToken(limit);
+        return;
+    }
     if( !isJobRunning(eventsHistoryJob) )
     {
+        prefetchingHistory = false;
         eventsHistoryJob =
-            connection->callApi<GetRoomEventsJob>(id, prevBatch, "b", "", limit);
+            connection->callApi<GetHistoryChunkJob>(id, prevBatch, "b", "", limit);
         emit q->eventsHistoryJobChanged();
         connect( eventsHistoryJob, &BaseJob::success, q, [=] {
             prevBatch = eventsHistoryJob->end();
             addHistoricalMessageEvents(eventsHistoryJob->chunk());
+            if (!fragments.empty())
+                mergeFragments();
+            prefetchingHistory = false;
+            prefetchHistory();
         });
         connect( eventsHistoryJob, &QObject::destroyed,
                  q, &Room::eventsHistoryJobChanged);
     }
 }
 
+void Room::Private::restoreHistoryToken(int limit)
+{
+    if (isJobRunning(historyTokenJob) || timeline.empty())
+        return;
+    // The context of the oldest event brings a token to paginate from
+    // along with a page of history before the event
+    prefetchingHistory = false;
+    historyTokenJob = connection->callApi<GetEventContextJob>(id,
+                            timeline.front()->id(), limit);
+    connect(historyTokenJob, &BaseJob::success, q, [this] {
+        prevBatch = historyTokenJob->begin();
+        historyTokenLost = false;
+        addHistoricalMessageEvents(historyTokenJob->eventsBefore());
+        prefetchHistory();
+    });
+}
+
+int Room::historyPrefetchScreens() const
+{
+    return d->historyPrefetchScreens;
+}
+
+void Room::setHistoryPrefetchScreens(int screens)
+{
+    d->historyPrefetchScreens = std::max(screens, 0);
+    d->prefetchHistory();
+}
+
+void Room::Private::updateScrollRate()
+{
+    const auto it = q->firstDisplayedMarker();
+    if (it == timeline.crend())
+        return;
+
+    const auto index = it->index();
+    if (scrollTimer.isValid())
+    {
+        const auto elapsedMs = std::max(scrollTimer.restart(), qint64(1));
+        const auto rate =
+                double(lastFirstDisplayedIndex - index) * 1000 / elapsedMs;
+        scrollRate = std::max((scrollRate + rate) / 2, 0.0);
+    } else
+        scrollTimer.start();
+    lastFirstDisplayedIndex = index;
+}
+
+void Room::Private::prefetchHistory()
+{
+    static const int MinScreenSize = 10;
+    static const int MaxPageSize = 200;
+
+    if (historyPrefetchScreens == 0 || !displayed || prevBatch.isEmpty() ||
+            isJobRunning(eventsHistoryJob))
+        return;
+    const auto firstIt = q->firstDisplayedMarker();
+    if (firstIt == timeline.crend())
+        return;
+
+    const auto lastIt = q->lastDisplayedMarker();
+    const auto screenSize = std::max(MinScreenSize, lastIt == timeline.crend()
+                                ? 0 : int(lastIt->index() - firstIt->index()) + 1);
+    const auto eventsAhead = int(firstIt->index() - q->minTimelineIndex());
+    const auto eventsNeeded = historyPrefetchScreens * screenSize - eventsAhead;
+    if (eventsNeeded <= 0)
+        return;
+
+    // Every screen per second of scrolling adds up a page
+    const auto pageSize = std::min(MaxPageSize,
+        int(std::max(eventsNeeded, screenSize) * (1 + scrollRate / screenSize)));
+    qCDebug(MAIN) << "Prefetching" << pageSize << "event(s) of history in"
+                  << q->objectName();
+    getPreviousContent(pageSize);
+    prefetchingHistory = true;
+}
+
+bool Room::hasGapBefore(TimelineItem::index_t index) const
+{
+    return d->timelineGaps.contains(index);
+}
+
+const RoomEvents* Room::fragmentWithEvent(const QString& eventId) const
+{
+    const auto it = d->findFragment(eventId);
+    return it != d->fragments.end() ? &it->events : nullptr;
+}
+
+void Room::loadEventContext(const QString& eventId, int limit)
+{
+    if (d->isLoaded(eventId) ||
+            d->findFragment(eventId) != d->fragments.end())
+    {
+        emit eventContextLoaded(eventId);
+        return;
+    }
+    auto* job = connection()->callApi<GetEventContextJob>(id(), eventId, limit);
+    connect(job, &BaseJob::success, this, [this, job, eventId] {
+        auto evt = job->event();
+        // The event might have come from elsewhere in the meantime
+        if (!d->isLoaded(eventId) &&
+                d->findFragment(eventId) == d->fragments.end())
+        {
+            if (!evt)
+            {
+                qCWarning(MAIN) << "No event" << eventId
+                                << "in the context returned by the server";
+                emit eventContextLoadFailed(eventId,
+                        QStringLiteral("No such event in the server response"));
+                return;
+            }
+            Private::TimelineFragment f { ++d->lastFragmentId };
+            auto before = job->eventsBefore(); // Reverse-chronological
+            auto after = job->eventsAfter();
+            f.events.reserve(before.size() + after.size() + 1);
+            std::move(before.rbegin(), before.rend(),
+                      std::back_inserter(f.events));
+            f.events.push_back(move(evt));
+            std::move(after.begin(), after.end(),
+                      std::back_inserter(f.events));
+            f.prevBatch = job->begin();
+            f.nextBatch = job->end();
+            qCDebug(MAIN) << "Loaded a fragment of" << f.events.size()
+                          << "event(s) around" << eventId << "in" << objectName();
+            d->fragments.push_back(move(f));
+            d->mergeFragments();
+            emit fragmentsChanged();
+        }
+        emit eventContextLoaded(eventId);
+    });
+    connect(job, &BaseJob::failure, this, [this, job, eventId] {
+        emit eventContextLoadFailed(eventId, job->errorString());
+    });
+}
+
+void Room::extendFragment(const QString& eventId, bool backwards, int limit)
+{
+    const auto it = d->findFragment(eventId);
+    if (it != d->fragments.end())
+        d->paginateFragment(it->id, backwards, limit);
+}
+
+void Room::Private::paginateFragment(int fragmentId, bool backwards, int limit)
+{
+    auto byId = [fragmentId] (const TimelineFragment& f) {
+        return f.id == fragmentId;
+    };
+    auto fIt = std::find_if(fragments.begin(), fragments.end(), byId);
+    if (fIt == fragments.end() || isJobRunning(fIt->job))
+        return;
+    const auto from = backwards ? fIt->prevBatch : fIt->nextBatch;
+    if (from.isEmpty())
+        return; // The fragment has reached the room creation or the present
+
+    auto* job = connection->callApi<GetHistoryChunkJob>(id, from,
+                    backwards ? "b" : "f", "", limit);
+    fIt->job = job;
+    connect(job, &BaseJob::success, q, [this, job, byId, backwards, from] {
+        const auto it = std::find_if(fragments.begin(), fragments.end(), byId);
+        if (it == fragments.end())
+            return; // Merged away in the meantime
+        auto& f = *it;
+        auto chunk = job->chunk();
+        // An empty chunk (before deduplication) or a token that doesn't
+        // advance means there's nothing more in that direction
+        const auto nextToken = chunk.empty() || job->end() == from
+                               ? QString() : job->end();
+        chunk.erase(remove_if(chunk.begin(), chunk.end(),
+                [&f] (const RoomEventPtr& e) { return f.contains(e->id()); }),
+            chunk.end());
+        if (backwards)
+        {
+            f.prevBatch = nextToken;
+            f.events.insert(f.events.begin(),
+                            std::make_move_iterator(chunk.rbegin()),
+                            std::make_move_iterator(chunk.rend()));
+        } else {
+            f.nextBatch = nextToken;
+            std::move(chunk.begin(), chunk.end(),
+                      std::back_inserter(f.events));
+        }
+        mergeFragments();
+        emit q->fragmentsChanged();
+    });
+}
+
+bool Room::Private::joinFragments(TimelineFragment& f1, TimelineFragment& f2)
+{
+    if (!f1.contains(f2.events.front()->id()))
+    {
+        if (!f2.contains(f1.events.front()->id()))
+            return false;
+        // Make f1 the one that starts earlier
+        std::swap(f1.events, f2.events);
+        std::swap(f1.prevBatch, f2.prevBatch);
+        std::swap(f1.nextBatch, f2.nextBatch);
+    }
+    // If f2 doesn't contain the end of f1, f1 contains the whole f2
+    const auto lastIt = f2.find(f1.events.back()->id());
+    if (lastIt != f2.events.end() && lastIt + 1 != f2.events.end())
+    {
+        std::move(f2.events.begin() + (lastIt + 1 - f2.events.cbegin()),
+                  f2.events.end(), std::back_inserter(f1.events));
+        f1.nextBatch = f2.nextBatch;
+    }
+    return true;
+}
+
+void Room::Private::mergeFragments()
+{
+    auto dropFragment = [this] (fragments_t::iterator it) {
+        if (isJobRunning(it->job))
+            it->job->abandon();
+        return fragments.erase(it);
+    };
+    for (auto it = fragments.begin(); it != fragments.end(); ++it)
+        for (auto otherIt = std::next(it); otherIt != fragments.end();)
+        {
+            if (!joinFragments(*it, *otherIt))
+            {
+                ++otherIt;
+                continue;
+            }
+            // Requests were made against the fragments before joining
+            if (isJobRunning(it->job))
+                it->job->abandon();
+            otherIt = dropFragment(otherIt);
+        }
+
+    if (timeline.empty())
+        return;
+    for (auto it = fragments.begin(); it != fragments.end();)
+    {
+        auto& events = it->events;
+        const auto meetIt = std::find_if(events.begin(), events.end(),
+            [this] (const RoomEventPtr& e) {
+                return isLoaded(e->id());
+            });
+        // Fragments meeting the timeline elsewhere than at its oldest end
+        // stay detached - there's no way to insert events mid-timeline.
+        if (meetIt == events.end() || (*meetIt)->id() != timeline.front()->id())
+        {
+            ++it;
+            continue;
+        }
+        qCDebug(MAIN) << "Merging a fragment of" << events.size()
+                      << "event(s) into the timeline of" << q->objectName();
+        RoomEvents olderEvents; // Reverse-chronological, as from /messages
+        std::move(std::make_reverse_iterator(meetIt), events.rend(),
+                  std::back_inserter(olderEvents));
+        if (!olderEvents.empty())
+        {
+            prevBatch = it->prevBatch;
+            addHistoricalMessageEvents(move(olderEvents));
+        }
+        it = dropFragment(it);
+    }
+}
+
 void Room::inviteToRoom(const QString& memberId)
 {
     connection()->callApi<InviteUserJob>(id(), memberId);
@@ -1502,27 +2802,26 @@ void Room::downloadFile(const QString& eventId, const QUrl& localFilename)
         filePath = QDir::tempPath() % '/' % filePath.replace(':', '_') %
                 '#' % d->fileNameToDownload(event);
     }
-    auto job = connection()->downloadFile(fileUrl, filePath);
-    if (isJobRunning(job))
-    {
-        // If there was a previous transfer (completed or failed), remove it.
-        d->fileTransfers.remove(eventId);
-        d->fileTransfers.insert(eventId, { job, job->targetFileName() });
-        connect(job, &BaseJob::downloadProgress, this,
-            [this,eventId] (qint64 received, qint64 total) {
-                d->fileTransfers[eventId].update(received, total);
-                emit fileTransferProgress(eventId, received, total);
-            });
-        connect(job, &BaseJob::success, this, [this,eventId,fileUrl,job] {
-                d->fileTransfers[eventId].status = FileTransferInfo::Completed;
-                emit fileTransferCompleted(eventId, fileUrl,
-                        QUrl::fromLocalFile(job->targetFileName()));
-            });
-        connect(job, &BaseJob::failure, this,
-                std::bind(&Private::failedTransfer, d,
-                          eventId, job->errorString()));
-    } else
-        d->failedTransfer(eventId);
+    auto* request = connection()->downloadManager()->download(fileUrl, filePath);
+    // If there was a previous transfer (completed or failed), remove it.
+    d->fileTransfers.remove(eventId);
+    d->fileTransfers.insert(eventId, { nullptr, request->localFileName() });
+    d->fileTransfers[eventId].download = request;
+    connect(request, &DownloadRequest::progress, this,
+        [this,eventId] (qint64 received, qint64 total) {
+            d->fileTransfers[eventId].update(received, total);
+            emit fileTransferProgress(eventId, received, total);
+        });
+    connect(request, &DownloadRequest::completed, this,
+        [this,eventId,fileUrl] (const QString& fileName) {
+            d->fileTransfers[eventId].status = FileTransferInfo::Completed;
+            emit fileTransferCompleted(eventId, fileUrl,
+                                       QUrl::fromLocalFile(fileName));
+        });
+    connect(request, &DownloadRequest::failed, this,
+        [this,eventId] (const QString& errorMessage) {
+            d->failedTransfer(eventId, errorMessage);
+        });
 }
 
 void Room::cancelFileTransfer(const QString& id)
@@ -1534,7 +2833,9 @@ void Room::cancelFileTransfer(const QString& id)
                         << "in room" << d->id;
         return;
     }
-    if (isJobRunning(it->job))
+    if (it->download)
+        it->download->cancel();
+    else if (isJobRunning(it->job))
         it->job->abandon();
     d->fileTransfers.remove(id);
     emit fileTransferCancelled(id);
@@ -1549,7 +2850,7 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
     // 1. Check for duplicates against the timeline.
     auto dupsBegin = remove_if(events.begin(), events.end(),
             [&] (const RoomEventPtr& e)
-                { return eventsIndex.contains(e->id()); });
+                { return isLoaded(e->id()); });
 
     // 2. Check for duplicates within the batch if there are still events.
     for (auto eIt = events.begin(); distance(eIt, dupsBegin) > 1; ++eIt)
@@ -1627,8 +2928,8 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
 {
     // Can't use findInTimeline because it returns a const iterator, and
     // we need to change the underlying TimelineItem.
-    const auto pIdx = eventsIndex.find(redaction.redactedEvent());
-    if (pIdx == eventsIndex.end())
+    const auto* pIdx = findIndex(redaction.redactedEvent());
+    if (!pIdx)
         return false;
 
     Q_ASSERT(q->isValidIndex(*pIdx));
@@ -1642,7 +2943,8 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
     }
 
     // Make a new event from the redacted JSON and put it in the timeline
-    // instead of the redacted one. oldEvent will be deleted on return.
+    // instead of the redacted one. oldEvent will be deleted on return unless
+    // someone still holds a handle to it.
     auto oldEvent = ti.replaceEvent(makeRedacted(*ti, redaction));
     qCDebug(MAIN) << "Redacted" << oldEvent->id() << "with" << redaction.id();
     if (oldEvent->isStateEvent())
@@ -1660,8 +2962,9 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
             updateDisplayname();
         }
     }
+    publishTimelineItem(ti);
     q->onRedaction(*oldEvent, *ti);
-    emit q->replacedEvent(ti.event(), rawPtr(oldEvent));
+    emit q->replacedEvent(ti.event(), oldEvent.get());
     return true;
 }
 
@@ -1724,9 +3027,14 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
     auto totalInserted = 0;
     for (auto it = events.begin(); it != events.end();)
     {
-        auto nextPendingPair = findFirstOf(it, events.end(),
-                    unsyncedEvents.begin(), unsyncedEvents.end(), isEchoEvent);
-        auto nextPending = nextPendingPair.first;
+        auto nextPending = it;
+        auto pendingIt = unsyncedEvents.end();
+        for (; nextPending != events.end(); ++nextPending)
+        {
+            pendingIt = findEchoOf(**nextPending);
+            if (pendingIt != unsyncedEvents.end())
+                break;
+        }
 
         if (it != nextPending)
         {
@@ -1743,11 +3051,11 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
 
         it = nextPending + 1;
         emit q->pendingEventAboutToMerge(nextPending->get(),
-                    nextPendingPair.second - unsyncedEvents.begin());
+                    pendingIt - unsyncedEvents.begin());
         qDebug(EVENTS) << "Merging pending event from transaction"
                        << (*nextPending)->transactionId() << "into"
                        << (*nextPending)->id();
-        unsyncedEvents.erase(nextPendingPair.second);
+        erasePendingEvent(pendingIt);
         if (auto insertedSize = moveEventsToTimeline({nextPending, it}, Newer))
         {
             totalInserted += insertedSize;
@@ -1785,6 +3093,9 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
 
         updateUnreadCount(timeline.crbegin(), rev_iter_t(from));
     }
+    for (auto it = from; it != timeline.cend(); ++it)
+        prepareForStorage(**it);
+    publishTimelineItems(from, timeline.cend());
 
     Q_ASSERT(timeline.size() == timelineSize + totalInserted);
     return stateChanges;
@@ -1824,6 +3135,9 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
 
     if (from <= q->readMarker())
         updateUnreadCount(from, timeline.crend());
+    for (auto it = from; it != timeline.crend(); ++it)
+        prepareForStorage(**it);
+    publishTimelineItems(from, timeline.crend());
 
     Q_ASSERT(timeline.size() == timelineSize + insertedSize);
     if (insertedSize > 9 || et.nsecsElapsed() >= profilerMinNsecs())
@@ -1836,8 +3150,9 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
     if (!e.isStateEvent())
         return Change::NoChange;
 
-    d->currentState[{e.matrixType(),e.stateKey()}] =
-            static_cast<const StateEventBase*>(&e);
+    const StateEventKey key { e.matrixType(), e.stateKey() };
+    d->currentState[key] = static_cast<const StateEventBase*>(&e);
+    d->markStateChanged(key);
     if (!is<RoomMemberEvent>(e))
         qCDebug(EVENTS) << "Room state event:" << e;
 
@@ -2109,12 +3424,13 @@ QJsonObject Room::Private::toJson() const
         for (const auto* evt: currentState)
         {
             Q_ASSERT(evt->isStateEvent());
+            // Compact events are decoded here without keeping the result
+            auto json = evt->originalJsonObject();
             if ((evt->isRedacted() && !is<RoomMemberEvent>(*evt)) ||
-                    evt->contentJson().isEmpty())
+                    json.value(ContentKeyL).toObject().isEmpty())
                 continue;
 
-            auto json = evt->fullJson();
-            auto unsignedJson = evt->unsignedJson();
+            auto unsignedJson = json.value(UnsignedKeyL).toObject();
             unsignedJson.remove(QStringLiteral("prev_content"));
             json[UnsignedKeyL] = unsignedJson;
             stateEvents.append(json);
@@ -2132,7 +3448,7 @@ QJsonObject Room::Private::toJson() const
         for (const auto& e: accountData)
         {
             if (!e.second->contentJson().isEmpty())
-                accountDataEvents.append(e.second->fullJson());
+                accountDataEvents.append(e.second->originalJsonObject());
         }
         result.insert(QStringLiteral("account_data"),
                       QJsonObject {{ QStringLiteral("events"), accountDataEvents }});
@@ -2147,6 +3463,8 @@ QJsonObject Room::Private::toJson() const
         unreadNotifObj.insert(QStringLiteral("notification_count"), notificationCount);
 
     result.insert(QStringLiteral("unread_notifications"), unreadNotifObj);
+    if (allMembersLoaded)
+        result.insert(SyncRoomData::MembersLoadedKey, true);
 
     if (et.elapsed() > 30)
         qCDebug(PROFILER) << "Room::toJson() for" << displayname << "took" << et;
@@ -22,6 +22,7 @@
 #include "events/roommessageevent.h"
 #include "events/accountdataevents.h"
 #include "eventitem.h"
+#include "roomsnapshot.h"
 #include "joinstate.h"
 
 #include <QtGui/QImage>
@@ -66,6 +67,41 @@ namespace QMatrixClient
             bool failed() const { return status == Failed; }
     };
 
+    /** Estimated memory taken by a room or a connection, by component
+     *
+     * Events are accounted by the size of their JSON; containers by
+     * the size of their entries, disregarding allocator overhead.
+     * \sa Room::memoryUsage, Connection::memoryUsage
+     */
+    struct MemoryUsage
+    {
+        qint64 timelineEvents = 0; ///< Including detached history fragments
+        qint64 stateEvents = 0; ///< State before the timeline, w/o members
+        qint64 members = 0; ///< Member events and the member map
+        qint64 receipts = 0;
+        qint64 avatars = 0; ///< Decoded avatar images
+        qint64 pendingEvents = 0;
+        /// Parts of event arena blocks not taken by live events
+        qint64 arenaWaste = 0;
+
+        qint64 total() const
+        {
+            return timelineEvents + stateEvents + members + receipts
+                    + avatars + pendingEvents + arenaWaste;
+        }
+        MemoryUsage& operator+=(const MemoryUsage& other)
+        {
+            timelineEvents += other.timelineEvents;
+            stateEvents += other.stateEvents;
+            members += other.members;
+            receipts += other.receipts;
+            avatars += other.avatars;
+            pendingEvents += other.pendingEvents;
+            arenaWaste += other.arenaWaste;
+            return *this;
+        }
+    };
+
     class Room: public QObject
     {
             Q_OBJECT
@@ -144,7 +180,44 @@ namespace QMatrixClient
             Q_INVOKABLE QList<User*> users() const;
             QStringList memberNames() const;
             int memberCount() const;
+            /** Whether the full member list has been loaded from the server
+             * \sa loadMembers
+             */
+            bool allMembersLoaded() const;
             int timelineSize() const;
+            /** Estimate the memory taken by the room
+             * This walks all the events in the room, so it's not cheap.
+             * Only the room's own avatar is accounted for.
+             */
+            MemoryUsage memoryUsage() const;
+            /** Store all the events of the room as compact JSON
+             * This also drops the JSON decoded since the events were
+             * compacted. New events are compacted as they arrive if
+             * Connection::compactEventStorage() is enabled. Events held
+             * by snapshots taken earlier are left alone, as other threads
+             * may be reading them.
+             * \sa Event::compact
+             */
+            void compactEvents() const;
+
+            /** Get an immutable snapshot of the current room state
+             * The snapshot can be read from other threads. Taking it
+             * copies a reference and applies the state changes made since
+             * the previous snapshot; only the first one is built from
+             * the whole state.
+             */
+            RoomStateSnapshot stateSnapshot() const;
+            /** Get an immutable snapshot of a range of the timeline
+             * The range is clamped to the loaded timeline. The snapshot
+             * can be read from other threads; taking it costs O(1), except
+             * for the first one after the room is loaded or its history is
+             * trimmed.
+             * \sa TimelineSnapshot
+             */
+            TimelineSnapshot timelineSnapshot(
+                TimelineItem::index_t from, TimelineItem::index_t to) const;
+            /// Get an immutable snapshot of the whole loaded timeline
+            TimelineSnapshot timelineSnapshot() const;
             bool usesEncryption() const;
 
             GetRoomEventsJob* eventsHistoryJob() const;
@@ -163,6 +236,8 @@ namespace QMatrixClient
              * available yet
              */
             Q_INVOKABLE QImage avatar(int width, int height);
+            /// Fetch the room avatar in advance \sa Avatar::prefetch
+            Q_INVOKABLE void prefetchAvatar(int dimension);
 
             /**
              * \brief Get a user object for a given user id
@@ -199,6 +274,16 @@ namespace QMatrixClient
 
             const Timeline& messageEvents() const;
             const PendingEvents& pendingEvents() const;
+            /** The maximal number of pending events sent at the same time
+             *
+             * Pending events are sent in the order of submission. If sending
+             * an event fails, further events are held until it's retried or
+             * discarded. Pending events are saved next to the state cache
+             * before sending and resent after restart. The default is 1,
+             * which strictly preserves the order of events on the server.
+             */
+            int maxEventsInFlight() const;
+            void setMaxEventsInFlight(int newMax);
             /**
              * A convenience method returning the read marker to the position
              * before the "oldest" event; same as messageEvents().crend()
@@ -218,6 +303,31 @@ namespace QMatrixClient
             rev_iter_t findInTimeline(TimelineItem::index_t index) const;
             rev_iter_t findInTimeline(const QString& evtId) const;
 
+            /** Check whether events are missing before the given timeline item
+             *
+             * A gap occurs when a sync brings a limited timeline that doesn't
+             * connect to the events loaded before.
+             */
+            Q_INVOKABLE bool hasGapBefore(TimelineItem::index_t index) const;
+            /** Load the events missing before the given timeline item
+             *
+             * Events can't be inserted in the middle of the timeline, so
+             * the history before the gap is dropped (as by trimHistory())
+             * and the timeline is paginated back into the gap instead;
+             * the dropped events are loaded again by further pagination.
+             * \sa hasGapBefore, getPreviousContent
+             */
+            Q_INVOKABLE void fillGap(TimelineItem::index_t index,
+                                     int limit = 10);
+            /** Find a detached fragment of history containing the event
+             *
+             * Fragments are loaded by loadEventContext() and are not a part
+             * of messageEvents() until they connect to its oldest event.
+             * \return the events of the fragment, the oldest first; nullptr
+             *         if the event is not in any fragment
+             */
+            const RoomEvents* fragmentWithEvent(const QString& eventId) const;
+
             bool displayed() const;
             void setDisplayed(bool displayed = true);
             QString firstDisplayedEventId() const;
@@ -229,6 +339,18 @@ namespace QMatrixClient
             void setLastDisplayedEventId(const QString& eventId);
             void setLastDisplayedEvent(TimelineItem::index_t index);
 
+            /** How much history to keep loaded ahead of the displayed events
+             *
+             * While the room is displayed, history is requested in the
+             * background to keep this many screens of events above the first
+             * displayed event; a screen is the span between the first and
+             * the last displayed events. Pages grow when scrolling fast;
+             * hiding the room cancels prefetching. 0 (default) disables it.
+             * \sa setFirstDisplayedEventId, setLastDisplayedEventId
+             */
+            int historyPrefetchScreens() const;
+            void setHistoryPrefetchScreens(int screens);
+
             rev_iter_t readMarker(const User* user) const;
             rev_iter_t readMarker() const;
             QString readMarkerEventId() const;
@@ -365,6 +487,50 @@ namespace QMatrixClient
             void setTopic(const QString& newTopic);
 
             void getPreviousContent(int limit = 10);
+            /** Load the complete list of room members
+             *
+             * With lazy-loaded members (see SyncFilterConfig) syncs only bring
+             * members needed to display the timeline. This requests the full
+             * list as of the latest sync and saves it to the room cache.
+             * Does nothing if the list is already loaded or being loaded.
+             * \sa allMembersLoaded, membersLoaded
+             */
+            void loadMembers();
+            /** Drop members that are not needed to display the room
+             *
+             * This is the reverse of loadMembers(): member events that are
+             * not needed to display the current timeline are dropped, and
+             * allMembersLoaded() becomes false until the list is loaded
+             * again, which happens automatically once the room is
+             * displayed. Does nothing for displayed rooms, rooms not in
+             * Join state and rooms named after their members.
+             * \return the estimated number of bytes freed
+             */
+            qint64 unloadMembers();
+            /** Drop the history older than the read marker
+             *
+             * The read marker event and the displayed events are kept.
+             * The dropped history is requested from the server again when
+             * getPreviousContent() is called; detached fragments of history
+             * are dropped as well.
+             * \return the estimated number of bytes freed
+             * \sa aboutToTrimHistory, historyTrimmed
+             */
+            qint64 trimHistory();
+            /** Load events around a given one
+             *
+             * Unless the event is already loaded this makes a single request
+             * for the event with its surroundings and stores them as
+             * a detached fragment of history; eventContextLoaded() is
+             * emitted once the event is available in either the timeline or
+             * a fragment, eventContextLoadFailed() if it can't be loaded. Fragments are merged with each other when they
+             * overlap, and with the timeline when they reach its oldest event.
+             * \sa fragmentWithEvent, extendFragment
+             */
+            void loadEventContext(const QString& eventId, int limit = 10);
+            /// Load more history around the fragment containing the event
+            void extendFragment(const QString& eventId, bool backwards,
+                                int limit = 10);
 
             void inviteToRoom(const QString& memberId);
             LeaveRoomJob* leaveRoom();
@@ -385,12 +551,25 @@ namespace QMatrixClient
 
             /// Mark all messages in the room as read
             void markAllMessagesAsRead();
+            /** Send a read receipt for the event
+             * The receipt is coalesced with other read markers of the room
+             * and sent within a second.
+             */
+            void postReceipt(const QString& eventId);
 
         signals:
             void eventsHistoryJobChanged();
             void aboutToAddHistoricalMessages(RoomEventsRange events);
             void aboutToAddNewMessages(RoomEventsRange events);
             void addedMessages(int fromIndex, int toIndex);
+            /// Events before \p newMinIndex are about to be dropped
+            void aboutToTrimHistory(int newMinIndex);
+            void historyTrimmed();
+            void eventContextLoaded(QString eventId);
+            void eventContextLoadFailed(QString eventId,
+                                        QString errorMessage);
+            /// Fragments of history have been added, extended or merged
+            void fragmentsChanged();
             void pendingEventAboutToAdd();
             void pendingEventAdded();
             void pendingEventAboutToMerge(RoomEvent* serverEvent,
@@ -422,6 +601,8 @@ namespace QMatrixClient
             void memberAboutToRename(User* user, QString newName);
             void memberRenamed(User* user);
             void memberListChanged();
+            /// The full member list has been loaded \sa loadMembers
+            void membersLoaded();
             void encryption();
 
             void joinStateChanged(JoinState oldState, JoinState newState);
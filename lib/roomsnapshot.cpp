@@ -0,0 +1,76 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "roomsnapshot.h"
+
+#include <algorithm>
+
+using namespace QMatrixClient;
+
+int RoomStateSnapshot::size() const
+{
+    int result = 0;
+    for (const auto& chunk: _chunks)
+        result += chunk->size();
+    return result;
+}
+
+StateEventHandle RoomStateSnapshot::get(const QString& evtType,
+                                        const QString& stateKey) const
+{
+    const StateEventKey key { evtType, stateKey };
+    const auto chunk = _chunks.value(_impl::stateChunkKey(key));
+    return chunk ? chunk->value(key) : nullptr;
+}
+
+QVector<StateEventHandle> RoomStateSnapshot::events() const
+{
+    QVector<StateEventHandle> result;
+    result.reserve(size());
+    for (const auto& chunk: _chunks)
+        for (const auto& e: *chunk)
+            result.push_back(e);
+    return result;
+}
+
+RoomEventHandle TimelineSnapshot::at(index_t index) const
+{
+    if (index < _minIndex || index > _maxIndex)
+        return nullptr;
+    const auto key = _impl::timelineChunkKey(index);
+    const auto chunk = _chunks.value(key);
+    Q_ASSERT(chunk);
+    return chunk->at(size_t(index - key * _impl::TimelineChunkSize));
+}
+
+QVector<RoomEventHandle> TimelineSnapshot::events() const
+{
+    QVector<RoomEventHandle> result;
+    result.reserve(size());
+    for (auto i = _minIndex; i <= _maxIndex;)
+    {
+        const auto key = _impl::timelineChunkKey(i);
+        const auto chunk = _chunks.value(key);
+        const auto chunkStart = key * _impl::TimelineChunkSize;
+        const auto chunkEnd =
+            std::min(chunkStart + _impl::TimelineChunkSize - 1, _maxIndex);
+        for (; i <= chunkEnd; ++i)
+            result.push_back((*chunk)[size_t(i - chunkStart)]);
+    }
+    return result;
+}
@@ -0,0 +1,123 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "eventitem.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QVector>
+
+#include <memory>
+#include <vector>
+
+namespace QMatrixClient
+{
+    namespace _impl
+    {
+        /// A fixed-size run of timeline handles, shared between snapshots
+        using TimelineChunk = std::vector<RoomEventHandle>;
+        using TimelineChunks = QMap<int, std::shared_ptr<TimelineChunk>>;
+        constexpr int TimelineChunkSize = 256;
+
+        inline int timelineChunkKey(TimelineItem::index_t index)
+        {
+            return index >= 0 ? index / TimelineChunkSize
+                              : -((-index - 1) / TimelineChunkSize) - 1;
+        }
+
+        /// A part of the room state, shared between snapshots; the state
+        /// is split by the hash of the key so that a change only copies
+        /// the part it falls into
+        using StateChunk = QHash<StateEventKey, StateEventHandle>;
+        using StateChunks = QMap<uint, std::shared_ptr<StateChunk>>;
+        constexpr uint StateChunkCount = 64;
+
+        inline uint stateChunkKey(const StateEventKey& key)
+        {
+            return qHash(key) % StateChunkCount;
+        }
+    }  // namespace _impl
+
+    /** An immutable snapshot of the current state of a room
+     *
+     * Snapshots are cheap to copy and can be passed to and read from any
+     * thread. The events are held through shared handles, so they stay
+     * valid after the room state changes or the room is deleted. Like
+     * TimelineSnapshot, snapshots share chunks of the state with the room.
+     * \sa Room::stateSnapshot
+     */
+    class RoomStateSnapshot
+    {
+        public:
+            QString roomId() const { return _roomId; }
+            int size() const;
+
+            /// The state event, or nullptr if there's none in the snapshot
+            StateEventHandle get(const QString& evtType,
+                                 const QString& stateKey = {}) const;
+            template <typename EventT>
+            const EventT* get(const QString& stateKey = {}) const
+            {
+                const auto evt = get(EventT::matrixTypeId(), stateKey);
+                return evt ? eventCast<const EventT>(evt) : nullptr;
+            }
+            QVector<StateEventHandle> events() const;
+
+        private:
+            friend class Room;
+            QString _roomId;
+            _impl::StateChunks _chunks;
+    };
+
+    /** An immutable snapshot of a range of the room timeline
+     *
+     * Like the timeline, the snapshot is addressed by timeline indices.
+     * Taking a snapshot doesn't copy the events or the list of them:
+     * snapshots share fixed-size chunks of the list with the room, which
+     * copies a chunk only when it changes while a snapshot uses it.
+     * Snapshots can be passed to and read from any thread.
+     * \sa Room::timelineSnapshot
+     */
+    class TimelineSnapshot
+    {
+        public:
+            using index_t = TimelineItem::index_t;
+
+            QString roomId() const { return _roomId; }
+            bool isEmpty() const { return _maxIndex < _minIndex; }
+            int size() const { return isEmpty() ? 0 : _maxIndex - _minIndex + 1; }
+            index_t minIndex() const { return _minIndex; }
+            index_t maxIndex() const { return _maxIndex; }
+
+            /// The event at \p index, or nullptr if it's out of the range
+            RoomEventHandle at(index_t index) const;
+            /// All events of the snapshot, the oldest first
+            QVector<RoomEventHandle> events() const;
+
+        private:
+            friend class Room;
+            QString _roomId;
+            _impl::TimelineChunks _chunks;
+            index_t _minIndex = 0;
+            index_t _maxIndex = -1;
+    };
+}  // namespace QMatrixClient
+Q_DECLARE_METATYPE(QMatrixClient::RoomStateSnapshot)
+Q_DECLARE_METATYPE(QMatrixClient::TimelineSnapshot)
@@ -0,0 +1,41 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "stringpool.h"
+
+using namespace QMatrixClient;
+
+QString StringPool::intern(const QString& s)
+{
+    const auto it = _strings.constFind(s);
+    return it != _strings.cend() ? *it : *_strings.insert(s);
+}
+
+int StringPool::purge()
+{
+    int dropped = 0;
+    for (auto it = _strings.begin(); it != _strings.end();)
+        // The pool holds the only reference
+        if (it->isDetached())
+        {
+            it = _strings.erase(it);
+            ++dropped;
+        } else
+            ++it;
+    return dropped;
+}
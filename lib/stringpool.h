@@ -0,0 +1,48 @@
+/******************************************************************************
+ * Copyright (C) 2018 Kitsune Ral <kitsune-ral@users.sf.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QSet>
+#include <QtCore/QString>
+
+namespace QMatrixClient
+{
+    /** A table of interned strings
+     *
+     * Strings parsed from JSON each get their own storage even when they
+     * are equal. Interning makes equal strings share the storage of
+     * the copy kept in the pool, so that ids repeated across many events
+     * are stored only once. The pool is not thread-safe.
+     * \sa Connection::idPool
+     */
+    class StringPool
+    {
+        public:
+            /// Get the pooled copy of the string, adding it if needed
+            QString intern(const QString& s);
+            /** Drop strings no longer used outside the pool
+             * \return the number of strings dropped
+             */
+            int purge();
+            int size() const { return _strings.size(); }
+
+        private:
+            QSet<QString> _strings;
+    };
+}  // namespace QMatrixClient
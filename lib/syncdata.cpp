@@ -27,6 +27,8 @@ using namespace QMatrixClient;
 
 const QString SyncRoomData::UnreadCountKey =
         QStringLiteral("x-qmatrixclient.unread_count");
+const QString SyncRoomData::MembersLoadedKey =
+        QStringLiteral("x-qmatrixclient.members_loaded");
 
 template <typename EventsArrayT, typename StrT>
 inline EventsArrayT load(const QJsonObject& batches, StrT keyName)
@@ -38,9 +40,11 @@ SyncRoomData::SyncRoomData(const QString& roomId_, JoinState joinState_,
                            const QJsonObject& room_)
     : roomId(roomId_)
     , joinState(joinState_)
-    , state(load<StateEvents>(room_, joinState == JoinState::Invite
-                                     ? "invite_state"_ls : "state"_ls))
 {
+    // Events of the room in this batch are allocated and freed together
+    EventArena arena;
+    state = load<StateEvents>(room_, joinState == JoinState::Invite
+                                     ? "invite_state"_ls : "state"_ls);
     switch (joinState) {
         case JoinState::Join:
             ephemeral = load<Events>(room_, "ephemeral"_ls);
@@ -58,6 +62,9 @@ SyncRoomData::SyncRoomData(const QString& roomId_, JoinState joinState_,
         default: /* nothing on top of state */;
     }
 
+    // Only found in the local cache, never in a /sync response
+    membersLoaded = room_.value(MembersLoadedKey).toBool();
+
     const auto unreadJson = room_.value("unread_notifications"_ls).toObject();
     unreadCount = unreadJson.value(UnreadCountKey).toInt(-2);
     highlightCount = unreadJson.value("highlight_count"_ls).toInt();
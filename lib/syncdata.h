@@ -37,6 +37,7 @@ namespace QMatrixClient {
             int unreadCount;
             int highlightCount;
             int notificationCount;
+            bool membersLoaded = false;
 
             SyncRoomData(const QString& roomId, JoinState joinState_,
                          const QJsonObject& room_);
@@ -44,6 +45,7 @@ namespace QMatrixClient {
             SyncRoomData& operator=(SyncRoomData&&) = default;
 
             static const QString UnreadCountKey;
+            static const QString MembersLoadedKey;
     };
 
     // QVector cannot work with non-copiable objects, std::vector can.
@@ -70,7 +72,7 @@ namespace QMatrixClient {
 
             QStringList unresolvedRooms() const { return unresolvedRoomIds; }
 
-            static std::pair<int, int> cacheVersion() { return { 9, 0 }; }
+            static std::pair<int, int> cacheVersion() { return { 9, 1 }; }
             static QString fileNameForRoom(QString roomId);
 
         private:
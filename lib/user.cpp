@@ -367,6 +367,11 @@ QImage User::avatar(int width, int height, const Room* room,
                 [=] { emit avatarChanged(this, room); callback(); });
 }
 
+void User::prefetchAvatar(int dimension, const Room* room)
+{
+    avatarObject(room).prefetch(d->connection, dimension);
+}
+
 QString User::avatarMediaId(const Room* room) const
 {
     return avatarObject(room).mediaId();
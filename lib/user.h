@@ -101,6 +101,9 @@ namespace QMatrixClient
                                       const Room* room = nullptr);
             QImage avatar(int width, int height, const Room* room,
                           const Avatar::get_callback_t& callback);
+            /// Fetch the avatar in advance \sa Avatar::prefetch
+            Q_INVOKABLE void prefetchAvatar(int dimension,
+                                            const Room* room = nullptr);
 
             QString avatarMediaId(const Room* room = nullptr) const;
             QUrl avatarUrl(const Room* room = nullptr) const;
@@ -15,11 +15,19 @@ HEADERS += \
     $$SRCPATH/connection.h \
     $$SRCPATH/eventitem.h \
     $$SRCPATH/room.h \
+    $$SRCPATH/bulksender.h \
+    $$SRCPATH/downloadmanager.h \
     $$SRCPATH/user.h \
     $$SRCPATH/avatar.h \
+    $$SRCPATH/mediacache.h \
+    $$SRCPATH/imagedecoder.h \
     $$SRCPATH/syncdata.h \
+    $$SRCPATH/stringpool.h \
+    $$SRCPATH/eventindex.h \
+    $$SRCPATH/roomsnapshot.h \
     $$SRCPATH/util.h \
     $$SRCPATH/events/event.h \
+    $$SRCPATH/events/eventarena.h \
     $$SRCPATH/events/roomevent.h \
     $$SRCPATH/events/stateevent.h \
     $$SRCPATH/events/eventcontent.h \
@@ -59,11 +67,19 @@ SOURCES += \
     $$SRCPATH/connection.cpp \
     $$SRCPATH/eventitem.cpp \
     $$SRCPATH/room.cpp \
+    $$SRCPATH/bulksender.cpp \
+    $$SRCPATH/downloadmanager.cpp \
     $$SRCPATH/user.cpp \
     $$SRCPATH/avatar.cpp \
+    $$SRCPATH/mediacache.cpp \
+    $$SRCPATH/imagedecoder.cpp \
     $$SRCPATH/syncdata.cpp \
+    $$SRCPATH/stringpool.cpp \
+    $$SRCPATH/eventindex.cpp \
+    $$SRCPATH/roomsnapshot.cpp \
     $$SRCPATH/util.cpp \
     $$SRCPATH/events/event.cpp \
+    $$SRCPATH/events/eventarena.cpp \
     $$SRCPATH/events/roomevent.cpp \
     $$SRCPATH/events/stateevent.cpp \
     $$SRCPATH/events/eventcontent.cpp \